@@ -0,0 +1,273 @@
+// Bench
+// Timing runs for the packing and unpacking code, to catch speed regressions
+
+#define _CRT_SECURE_NO_WARNINGS
+#define _CRT_NON_CONFORMING_SWPRINTFS
+
+#include <Windows.h>
+#include <sys/stat.h>
+#include "stdint.h"
+#include <string>
+#include <vector>
+#include "lzss.h"
+#include "pbg6.h"
+#include "bench.h"
+
+// Returns the speed of compress() on [data] in MB/s, and its output size
+// in [size]
+static double benchCompress(std::vector<uint8_t>& data, const unsigned int dictBits, const int options, size_t& size,
+	const int fewestRounds = BENCH_MIN_ROUNDS)
+{
+	LZSSEncoder encoder;
+	BenchTimer timer(fewestRounds);
+	while (timer.Running()) {
+		timer.Start();
+		size = encoder.Compress(&data[0], (int)data.size(), dictBits, options).size();
+		timer.Stop();
+	}
+	return timer.Rate((double)data.size());
+}
+
+bool benchLoadFolder(wchar_t inFolderName[], std::vector<std::string>& names,
+	std::vector<std::vector<uint8_t> >& inputs)
+{
+	WIN32_FIND_DATAW ffd;
+	HANDLE hFind = INVALID_HANDLE_VALUE;
+	// Form path to search for files
+	wchar_t searchPath[MAX_PATH];
+	swprintf(searchPath, L"%ls\\*", inFolderName);
+
+	hFind = FindFirstFileW(searchPath, &ffd);
+	if (hFind == INVALID_HANDLE_VALUE) {
+		return false;
+	}
+	do {
+		// Skip hidden files, directories, and ./..
+		if ((wcscmp(ffd.cFileName, L".") && wcscmp(ffd.cFileName, L".."))
+			&& !(ffd.dwFileAttributes & FILE_ATTRIBUTE_HIDDEN)
+			&& !(ffd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)) {
+			wchar_t filepath[MAX_PATH];
+			swprintf(filepath, L"%ls\\%ls", inFolderName, ffd.cFileName);
+			FILE* inFile = _wfopen(filepath, L"rb");
+			if (!inFile) {
+				continue;
+			}
+			struct _stat s;
+			_wstat(filepath, &s);
+			if (s.st_size == 0) {
+				fclose(inFile);
+				continue;
+			}
+			inputs.push_back(std::vector<uint8_t>(s.st_size));
+			fread(&inputs.back()[0], s.st_size, 1, inFile);
+			fclose(inFile);
+
+			int byteCount = WideCharToMultiByte(932, 0, ffd.cFileName, -1, NULL, 0, NULL, NULL);
+			std::vector<char> name(byteCount);
+			WideCharToMultiByte(932, 0, ffd.cFileName, -1, &name[0], byteCount, NULL, NULL);
+			names.push_back(&name[0]);
+		}
+	} while (FindNextFileW(hFind, &ffd));
+	return true;
+}
+
+std::vector<uint8_t> benchText(const size_t size)
+{
+	const char* words[] = {
+		"the", "of", "and", "to", "in", "is", "that", "it", "was", "for", "on", "with", "as", "at", "by",
+		"stage", "enemy", "bullet", "player", "boss", "spell", "card", "shot", "bomb", "score", "power",
+		"music", "graph", "sound", "script", "dialogue", "character", "appears", "attack", "pattern"
+	};
+	const size_t wordCount = (sizeof(words) / sizeof(words[0]));
+	BenchRandom random(2);
+	std::vector<uint8_t> text;
+	text.reserve(size + 16);
+	while (text.size() < size) {
+		// Short words are much more common than long ones
+		const char* word = words[(random.Next() % wordCount) * (random.Next() % wordCount) / wordCount];
+		for (; *word; ++word) {
+			text.push_back((uint8_t)*word);
+		}
+		const uint32_t end = (random.Next() % 16);
+		if (end == 0) {
+			text.push_back('.');
+			text.push_back('\r');
+			text.push_back('\n');
+		}
+		else {
+			if (end == 1) {
+				text.push_back(',');
+			}
+			text.push_back(' ');
+		}
+	}
+	text.resize(size);
+	return text;
+}
+
+std::vector<uint8_t> benchBitmap(const size_t width, const size_t height)
+{
+	BenchRandom random(3);
+	std::vector<uint8_t> bitmap(width * height);
+	for (size_t y = 0; y < height; ++y) {
+		for (size_t x = 0; x < width; ++x) {
+			uint8_t pixel = 0;
+			if ((x / 64) % 3 == 1) {
+				// Flat areas between the gradients
+				pixel = (uint8_t)(((y / 32) * 16) + 1);
+			}
+			else {
+				pixel = (uint8_t)(((x + y) / 4) + (random.Next() % 3));
+			}
+			bitmap[(y * width) + x] = pixel;
+		}
+	}
+	return bitmap;
+}
+
+std::vector<uint8_t> benchNoise(const size_t size)
+{
+	BenchRandom random(4);
+	std::vector<uint8_t> noise(size);
+	for (size_t i = 0; i < size; ++i) {
+		noise[i] = (uint8_t)random.Next();
+	}
+	return noise;
+}
+
+// Long runs of one byte used to send every position in them into the same
+// hash chain, which then got walked in full at every step, making them pack
+// ten times slower than ordinary data. A run is about the easiest input
+// there is, so this fails if one packs at less than half the speed of
+// ordinary data at any level, which leaves room for timing noise.
+static int benchRuns()
+{
+	const char* levelNames[] = { "fast", "default", "max", "optimal" };
+	const int inputCount = 2;
+	const char* inputNames[inputCount] = { "rows", "silence" };
+	std::vector<uint8_t> inputs[inputCount];
+	BenchRandom random(1);
+
+	// An 8-bit image, 1024 pixels wide, of blank rows with a few pixels each
+	inputs[0].resize(2048 * 1024);
+	for (size_t row = 0; row < 2048; ++row) {
+		for (int pixel = 0; pixel < 4; ++pixel) {
+			inputs[0][(row * 1024) + (random.Next() % 1024)] = (uint8_t)random.Next();
+		}
+	}
+
+	// 16-bit PCM silence with a short click every 4000 samples
+	inputs[1].resize(850000);
+	for (size_t sample = 0; sample + 32 <= inputs[1].size(); sample += 8000) {
+		for (int i = 0; i < 32; ++i) {
+			inputs[1][sample + i] = (uint8_t)random.Next();
+		}
+	}
+
+	// Ordinary data: bytes from a small alphabet, with no runs to speak of
+	std::vector<uint8_t> reference(inputs[0].size());
+	for (size_t i = 0; i < reference.size(); ++i) {
+		reference[i] = (uint8_t)('a' + (random.Next() % 16));
+	}
+
+	printf("LZSS packing speed on runs of one byte, against ordinary data\n");
+	int slow = 0;
+	for (unsigned int dictBits = 13; dictBits <= 15; dictBits += 2) {
+		for (int level = LZSS_LEVEL_FAST; level <= LZSS_LEVEL_OPTIMAL; ++level) {
+			size_t size = 0;
+			const double referenceSpeed = benchCompress(reference, dictBits, level, size);
+			for (int input = 0; input < inputCount; ++input) {
+				const double speed = benchCompress(inputs[input], dictBits, level, size);
+				const bool tooSlow = ((speed * 2) < referenceSpeed);
+				printf("%2u-bit %-8s %-8s %8.1f MB/s (ordinary data %8.1f MB/s)%s\n", dictBits, levelNames[level],
+					inputNames[input], speed, referenceSpeed, tooSlow ? " TOO SLOW" : "");
+				if (tooSlow) {
+					++slow;
+				}
+			}
+		}
+	}
+	if (slow) {
+		printf("%d run benchmark(s) packed at less than half the speed of ordinary data!\n", slow);
+		return -12;
+	}
+	return 0;
+}
+
+// Hash chains slow down a lot on large, repetitive images, where every key
+// has a long chain, which the binary tree match finder was added for.
+// Compares the two at every level and both dict sizes, on the files in
+// [inFolderName], or, if none is given, on a generated two-value dither
+// (the worst case for chains) and a generated bitmap.
+static int benchFinders(wchar_t inFolderName[])
+{
+	const char* levelNames[] = { "fast", "default", "max", "optimal" };
+	std::vector<std::string> names;
+	std::vector<std::vector<uint8_t> > inputs;
+	if (inFolderName) {
+		if (!benchLoadFolder(inFolderName, names, inputs)) {
+			printf("Given folder not found...\n");
+			return -3;
+		}
+	}
+	else {
+		BenchRandom random(6);
+		names.push_back("dither");
+		inputs.push_back(std::vector<uint8_t>(0x40000));
+		for (size_t i = 0; i < inputs.back().size(); ++i) {
+			inputs.back()[i] = (uint8_t)(0x10 + ((random.Next() >> 4) & 1));
+		}
+		names.push_back("bitmap");
+		inputs.push_back(benchBitmap(1024, 768));
+	}
+
+	printf("LZSS packing speed (MB/s) and size with hash chains and binary trees\n");
+	for (size_t input = 0; input < inputs.size(); ++input) {
+		for (unsigned int dictBits = 13; dictBits <= 15; dictBits += 2) {
+			for (int level = LZSS_LEVEL_FAST; level <= LZSS_LEVEL_OPTIMAL; ++level) {
+				size_t chainSize = 0;
+				size_t treeSize = 0;
+				// One round each, as the chains can take seconds on the dither
+				const double chainSpeed = benchCompress(inputs[input], dictBits, level | LZSS_FINDER_CHAIN,
+					chainSize, 1);
+				const double treeSpeed = benchCompress(inputs[input], dictBits, level | LZSS_FINDER_TREE,
+					treeSize, 1);
+				printf("%-12s %2u-bit %-8s chain %8.2f %9lu   tree %8.2f %9lu\n", names[input].c_str(), dictBits,
+					levelNames[level], chainSpeed, (unsigned long)chainSize, treeSpeed, (unsigned long)treeSize);
+			}
+		}
+	}
+	return 0;
+}
+
+// Print benchmark usage
+static void printBenchUsage()
+{
+	printf("Improper benchmark specified!\n");
+	printf("Benchmarks: runs, pbg6, finders (in_folder), or dicts (in_folder)\n");
+}
+
+// Run the benchmark suite called [suiteName], on the files in
+// [inFolderName] if it takes any and one is given (NULL otherwise)
+int bench(wchar_t suiteName[], wchar_t inFolderName[])
+{
+	// Store suite name as lowercase string
+	std::wstring lowercaseSuite = suiteName;
+	for (uint32_t charIndex = 0; charIndex < lowercaseSuite.length(); ++charIndex) {
+		lowercaseSuite[charIndex] = tolower(lowercaseSuite[charIndex]);
+	}
+	if (lowercaseSuite == L"runs") {
+		return benchRuns();
+	}
+	if (lowercaseSuite == L"pbg6") {
+		return pbg6Bench();
+	}
+	if (lowercaseSuite == L"finders") {
+		return benchFinders(inFolderName);
+	}
+	if (lowercaseSuite == L"dicts") {
+		return lzssBench(inFolderName);
+	}
+	printBenchUsage();
+	return -6;
+}
\ No newline at end of file
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <ctime>
+#include <string>
+#include <vector>
+#include "stdint.h"
+
+int bench(wchar_t suiteName[], wchar_t inFolderName[]);
+
+// Each measurement repeats its work for at least this many seconds and
+// rounds, and reports the fastest round
+const double BENCH_MIN_SECONDS = 0.25;
+const int BENCH_MIN_ROUNDS = 3;
+
+// Times rounds of the same work, each between Start() and Stop(), for as
+// long as Running() says. Only the fastest round counts, as anything else
+// that ran on the machine can only have slowed the others down.
+// Work that takes seconds per round can ask for fewer rounds.
+class BenchTimer {
+	clock_t first;
+	clock_t start;
+	clock_t best;
+	int rounds;
+	int minRounds;
+
+public:
+	BenchTimer(const int fewestRounds = BENCH_MIN_ROUNDS) {
+		first = clock();
+		start = first;
+		best = 0;
+		rounds = 0;
+		minRounds = fewestRounds;
+	}
+
+	bool Running() const {
+		return (rounds < minRounds) || ((clock() - first) < (clock_t)(BENCH_MIN_SECONDS * CLOCKS_PER_SEC));
+	}
+
+	void Start() {
+		start = clock();
+	}
+
+	void Stop() {
+		const clock_t ticks = (clock() - start);
+		if ((rounds++ == 0) || (ticks < best)) {
+			best = ticks;
+		}
+	}
+
+	// Millions of [units] per second in the fastest round, which counts
+	// as one clock tick if it was too fast for the clock to see at all
+	double Rate(const double units) const {
+		const double seconds = (double)((best > 0) ? best : 1) / CLOCKS_PER_SEC;
+		return (units / seconds) / 1000000.0;
+	}
+};
+
+// Deterministic pseudo-random numbers for generated inputs
+struct BenchRandom {
+	uint32_t state;
+
+	BenchRandom(uint32_t seed) {
+		state = seed;
+	}
+
+	uint32_t Next() {
+		state = (state * 1103515245) + 12345;
+		return (state >> 16);
+	}
+};
+
+// Reads every file in [inFolderName] into [inputs], and its name into
+// [names]. Returns false if the folder can't be found.
+bool benchLoadFolder(wchar_t inFolderName[], std::vector<std::string>& names,
+	std::vector<std::vector<uint8_t> >& inputs);
+
+// Generated inputs, the same on every run: English-like text, an 8-bit
+// image of gradients, flat areas and a little noise, and random bytes
+std::vector<uint8_t> benchText(const size_t size);
+std::vector<uint8_t> benchBitmap(const size_t width, const size_t height);
+std::vector<uint8_t> benchNoise(const size_t size);
\ No newline at end of file
@@ -0,0 +1,76 @@
+// CPU feature detection, for picking SIMD code paths at runtime
+
+#pragma once
+
+#include <Windows.h>
+
+#if defined(_M_IX86) || defined(_M_X64) || defined(__i386__) || defined(__x86_64__)
+#define PBGTK_SSE2
+#include <emmintrin.h>
+#endif
+
+// Carry-less multiplication, whose intrinsics first shipped with Visual
+// C++ 2008. GCC needs them enabled per function.
+#if defined(PBGTK_SSE2) && (defined(__GNUC__) || (defined(_MSC_VER) && (_MSC_VER >= 1500)))
+#define PBGTK_PCLMUL
+#include <wmmintrin.h>
+#ifdef __GNUC__
+#include <cpuid.h>
+#define PBGTK_TARGET_PCLMUL __attribute__((target("pclmul")))
+#else
+#include <intrin.h>
+#define PBGTK_TARGET_PCLMUL
+#endif
+#endif
+
+#ifndef PF_XMMI64_INSTRUCTIONS_AVAILABLE
+#define PF_XMMI64_INSTRUCTIONS_AVAILABLE 10
+#endif
+
+struct cpu
+{
+	// True if SSE2 code can run. Besides the CPU, this needs an OS that
+	// saves the SSE registers, which Windows 95 doesn't do, and which also
+	// lacks IsProcessorFeaturePresent() itself; so that gets looked up at
+	// runtime instead of being linked in.
+	// These checks aren't cached. Callers keep their result in a constant
+	// at namespace scope, which gets initialized before main() runs, and
+	// so before any worker thread starts. Visual C++ 2003 initializes a
+	// function-local static without any locking, so two threads could both
+	// end up doing it.
+	static bool has_sse2()
+	{
+#if defined(_M_X64) || defined(__x86_64__)
+		return true;
+#elif defined(PBGTK_SSE2)
+		typedef BOOL (WINAPI *feature_func)(DWORD);
+		HMODULE kernel32 = GetModuleHandleA("kernel32.dll");
+		if (!kernel32) {
+			return false;
+		}
+		feature_func isPresent = (feature_func)GetProcAddress(kernel32, "IsProcessorFeaturePresent");
+		return (isPresent && isPresent(PF_XMMI64_INSTRUCTIONS_AVAILABLE));
+#else
+		return false;
+#endif
+	}
+
+	// True if PCLMULQDQ code can run. The instruction only uses SSE
+	// registers, so the OS side is covered by has_sse2().
+	static bool has_pclmul()
+	{
+#if defined(PBGTK_PCLMUL) && defined(__GNUC__)
+		unsigned int eax, ebx, ecx, edx;
+		return (has_sse2() && __get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & (1 << 1)));
+#elif defined(PBGTK_PCLMUL)
+		int info[4];
+		if (!has_sse2()) {
+			return false;
+		}
+		__cpuid(info, 1);
+		return ((info[2] & (1 << 1)) != 0);
+#else
+		return false;
+#endif
+	}
+};
\ No newline at end of file
@@ -2,37 +2,15 @@
 
 #pragma once
 
+#include <cstddef>
 #include "stdint.h"
 
+// CRC32 with the zlib polynomial, as stored in the PBG5 and PBG6 tables of
+// contents. Uses PCLMULQDQ if the CPU has it, and constant lookup tables
+// otherwise.
 struct crc32
 {
-	static void generate_table(uint32_t(&table)[256])
-	{
-		uint32_t polynomial = 0xEDB88320;
-		for (uint32_t i = 0; i < 256; i++) 
-		{
-			uint32_t c = i;
-			for (size_t j = 0; j < 8; j++) 
-			{
-				if (c & 1) {
-					c = polynomial ^ (c >> 1);
-				}
-				else {
-					c >>= 1;
-				}
-			}
-			table[i] = c;
-		}
-	}
-
-	static uint32_t update(uint32_t (&table)[256], uint32_t initial, const void* buf, size_t len)
-	{
-		uint32_t c = initial ^ 0xFFFFFFFF;
-		const uint8_t* u = static_cast<const uint8_t*>(buf);
-		for (size_t i = 0; i < len; ++i) 
-		{
-			c = table[(c ^ u[i]) & 0xFF] ^ (c >> 8);
-		}
-		return c ^ 0xFFFFFFFF;
-	}
-};
+	// Returns the CRC of [len] bytes at [buf], continuing from [initial],
+	// the CRC of everything before them (0 to start a new one)
+	static uint32_t update(uint32_t initial, const void* buf, size_t len);
+};
\ No newline at end of file
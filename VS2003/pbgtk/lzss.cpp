@@ -1,6 +1,10 @@
 // LZSS implementation from nmlgc's ssg and thtk
 
+#include <Windows.h>
 #include "lzss.h"
+#include "crc32.h"
+#include "cpu.h"
+#include "bench.h"
 
 uint8_t BitReader::GetBit()
 {
@@ -47,209 +51,1443 @@ uint32_t BitReader::GetBits(size_t bitcount)
 	return (window >> (32 - bitcount));
 }
 
-void BitWriter::PutBit(uint8_t bit)
-{	
-	if (bit_cursor == 0)
-	{
-		buffer.push_back(0x00);
+void BitWriter::FlushWord()
+{
+	if ((pos + 4) > buffer.size()) {
+		buffer.resize((buffer.size() < 16) ? 32 : (buffer.size() * 2));
+	}
+	uint8_t* dst = &buffer[pos];
+	dst[0] = (uint8_t)(window >> 56);
+	dst[1] = (uint8_t)(window >> 48);
+	dst[2] = (uint8_t)(window >> 40);
+	dst[3] = (uint8_t)(window >> 32);
+	pos += 4;
+	window <<= 32;
+	count -= 32;
+}
+
+void BitWriter::Append(const BitWriter& other)
+{
+	// [other] only ever flushes whole words
+	Reserve(pos + other.pos + 8);
+	for (size_t i = 0; i < other.pos; i += 4) {
+		const uint8_t* src = &other.buffer[i];
+		PutBits(((uint32_t)src[0] << 24) | (src[1] << 16) | (src[2] << 8) | src[3], 32);
+	}
+	if (other.count != 0) {
+		PutBits((uint32_t)(other.window >> (64 - other.count)), other.count);
 	}
+}
+
+std::vector<uint8_t>& BitWriter::Finish()
+{
+	// Round up to whole bytes; the padding bits are already zero
+	count = ((count + 7) & ~7);
+	if (count >= 32) {
+		FlushWord();
+	}
+	Reserve(pos + (count / 8));
+	while (count != 0) {
+		buffer[pos++] = (uint8_t)(window >> 56);
+		window <<= 8;
+		count -= 8;
+	}
+	buffer.resize(pos);
+	return buffer;
+}
 
-	uint8_t& byte = buffer.back();
-	
-	byte |= ((bit & 1) << (7 - bit_cursor));
-	bit_cursor++;
+static uint8_t* grow_buffer(uint8_t*& buffer, size_t& capacity, const size_t size)
+{
+	if (size > capacity) {
+		delete[] buffer;
+		buffer = new uint8_t[size];
+		capacity = size;
+	}
+	return buffer;
+}
+
+uint8_t* LZSSDecoder::InputBuffer(size_t size)
+{
+	return grow_buffer(input, inputCapacity, size);
+}
+
+uint8_t* LZSSDecoder::OutputBuffer(size_t size)
+{
+	return grow_buffer(output, outputCapacity, size);
+}
+
+// Key of a position that starts with [run] (3 to 18) bytes of [byte]
+static inline unsigned int run_key(const unsigned int byte, const unsigned int run)
+{
+	return (((byte << 8) | byte) ^ (byte << 4)) ^ ((run - 3) << 12);
 }
 
-void BitWriter::PutBits(uint32_t bits, unsigned int bitcount)
+// Positions that start with 3 equal bytes also hash how far the run goes
+// on, up to LZSS_SEQ_MAX bytes, which is stored in [run] (0 otherwise).
+// Else every position in and around a run would share one chain, even
+// though a candidate can only match past the end of a run if its own run
+// ends at the same point. The bytes past the lookahead are still there
+// when a position leaves its chain, so this gives the same key both times.
+static inline unsigned int generate_key(unsigned char* array, const unsigned int base, const unsigned int mask,
+	unsigned int& run)
 {
-	uint32_t mask = (1 << (bitcount - 1));
-	for (unsigned int i = 0; i < bitcount; ++i) {
-		PutBit((bits & mask) != 0);
-		mask >>= 1;
+	const unsigned int LZSS_SEQ_MIN = 3;
+	const unsigned int LZSS_SEQ_BITS = 4;
+	const unsigned int LZSS_SEQ_MAX = (LZSS_SEQ_MIN + ((1 << LZSS_SEQ_BITS) - 1));
+	const unsigned int first = array[base];
+
+	if ((array[(base + 1) & mask] != first) || (array[(base + 2) & mask] != first)) {
+		run = 0;
+		return ((array[(base + 1) & mask] << 8) |
+			array[(base + 2) & mask]) ^ (first << 4);
 	}
+	for (run = LZSS_SEQ_MIN; (run < LZSS_SEQ_MAX) && (array[(base + run) & mask] == first); ++run)
+		;
+	return run_key(first, run);
+}
+
+// Returns the newest offset with the given key, or 0 if there is none
+static inline unsigned int list_head(const hash_t* hash, const unsigned int key)
+{
+	const uint32_t entry = hash->head[key];
+	return ((entry >> 16) == hash->epoch) ? (entry & 0xFFFF) : 0;
 }
 
-static inline unsigned int generate_key(unsigned char* array, const unsigned int base, const unsigned int mask)
+static inline unsigned int list_next(const hash_t* hash, const unsigned int offset)
 {
-	return ((array[(base + 1) & mask] << 8) |
-		array[(base + 2) & mask]) ^ (array[base] << 4);
+	return hash->links[(offset * 2) + 1];
 }
 
-static inline void list_remove(hash_t* hash, const unsigned int key, const unsigned int offset)
+// Only valid for offsets that were added in the current epoch, or left
+// out with list_skip()
+static inline void list_remove(hash_t* hash, unsigned char* dict, const unsigned int offset,
+	const unsigned int mask)
 {
 	// This function always removes the last entry in the list,
 	// or no entry at all
 
 	// Set any previous entry's next pointer to HASH_NULL
-	hash->next[hash->prev[offset]] = 0;
+	const unsigned int prev = hash->links[offset * 2];
+	hash->links[(prev * 2) + 1] = 0;
 
-	// XXX: This condition is not neccessary, but it might
-	// help optimization by not having to generate the key
-	if (hash->prev[offset] == 0)
+	// The last entry never has a next one, so one that does was left out.
+	// Only generate the key if the entry might be the head.
+	if (prev == 0 && hash->links[(offset * 2) + 1] == 0) {
 		// If the entry being removed was the head, clear the head
-		if (hash->hash[key] == offset)
-			hash->hash[key] = 0;
+		unsigned int run;
+		const unsigned int key = generate_key(dict, offset, mask, run);
+		if (list_head(hash, key) == offset)
+			hash->head[key] = 0;
+	}
 }
 
 static inline void list_add(hash_t* hash, const unsigned int key, const unsigned int offset)
 {
-	hash->next[offset] = hash->hash[key];
-	hash->prev[offset] = 0;
+	const unsigned int head = list_head(hash, key);
+	hash->links[(offset * 2) + 1] = (uint16_t)head;
+	hash->links[offset * 2] = 0;
 	// Update the previous pointer of the old head
-	hash->prev[hash->hash[key]] = offset;
-	hash->hash[key] = offset;
+	hash->links[head * 2] = (uint16_t)offset;
+	hash->head[key] = (((uint32_t)hash->epoch << 16) | offset);
 }
 
-static inline void output(uint8_t literal, uint8_t* uncompressed, uint8_t* dict, uint32_t& out_i, const unsigned int mask) {
-	uncompressed[out_i] = literal;
-	dict[out_i & mask] = literal;
-	++out_i;
+// Leaves [offset] out of the chains. With no previous entry, removing it
+// once its slot gets overwritten won't touch any chain, and linking it to
+// itself tells list_remove() not to look for it at the head either.
+static inline void list_skip(hash_t* hash, const unsigned int offset)
+{
+	hash->links[offset * 2] = 0;
+	hash->links[(offset * 2) + 1] = (uint16_t)offset;
 }
 
-// Generic LZSS decompression
-// Uses 15 dict bits if PBG5 or later, or 13 if PBG4 or earlier
-uint8_t* decompress(uint8_t* fileData, int uncompSize, int compSize, const unsigned int LZSS_DICT_BITS)
+// Copies a match of up to 24 bytes from [distance] bytes back in the output,
+// moving 8 or 16 bytes at a time. May write up to 24 bytes past [dst]
+// regardless of [length], so the caller has to leave that much room.
+static inline void copy_match(uint8_t* dst, const uint8_t* src, const uint32_t distance, const unsigned int length)
 {
+	if (distance >= 16) {
+		memcpy(dst, src, 16);
+		memcpy(dst + 16, src + 16, 8);
+	}
+	else if (distance >= 8) {
+		memcpy(dst, src, 8);
+		memcpy(dst + 8, src + 8, 8);
+		memcpy(dst + 16, src + 16, 8);
+	}
+	else if (distance == 1) {
+		// Run of a single byte
+		memset(dst, *src, 24);
+	}
+	else {
+		// Short repeating pattern: lay down the first 8 bytes one at a
+		// time, then copy from a whole number of periods back, which is
+		// at least 8 bytes away
+		const uint32_t period = ((8 + distance - 1) / distance) * distance;
+		for (unsigned int i = 0; i < 8; ++i) {
+			dst[i] = src[i];
+		}
+		if (length > 8) {
+			memcpy(dst + 8, dst + 8 - period, 8);
+			memcpy(dst + 16, dst + 16 - period, 8);
+		}
+	}
+}
+
+// Writes a match of [seq_length] bytes from [distance] bytes back, some of
+// which may lie in the zero fill before the start of [out]. Needs at least
+// 24 bytes of room past [out_i] for the fast copy.
+static inline void output_match(uint8_t* out, uint32_t& out_i, const uint32_t distance,
+	const unsigned int seq_length, const uint32_t room)
+{
+	if ((distance <= out_i) && (room >= 24)) {
+		copy_match(out + out_i, out + out_i - distance, distance, seq_length);
+		out_i += seq_length;
+		return;
+	}
+
+	// Near the end of the output, or reading from the zero fill
+	unsigned int i = 0;
+	for (; (i < seq_length) && (distance > out_i); ++i) {
+		out[out_i++] = 0;
+	}
+	const uint8_t* src = (out + out_i - distance);
+	for (; i < seq_length; ++i) {
+		out[out_i++] = *src++;
+	}
+}
+
+// Number of trailing 1 bits in a 6-bit value, i.e. the number of literals
+// that start a run of flag bits gathered by decode_literal_run()
+static const uint8_t literal_run_length[64] = {
+	0, 1, 0, 2, 0, 1, 0, 3, 0, 1, 0, 2, 0, 1, 0, 4,
+	0, 1, 0, 2, 0, 1, 0, 3, 0, 1, 0, 2, 0, 1, 0, 5,
+	0, 1, 0, 2, 0, 1, 0, 3, 0, 1, 0, 2, 0, 1, 0, 4,
+	0, 1, 0, 2, 0, 1, 0, 3, 0, 1, 0, 2, 0, 1, 0, 6
+};
+
+// Decodes the run of up to 6 literals at the start of [device], which must
+// hold at least 54 valid bits. All 6 bytes are written at [out_i] even if
+// the run is shorter. Returns the number of literals decoded.
+static inline unsigned int decode_literal_run(BitReader64& device, uint8_t* out, uint32_t& out_i)
+{
+	const uint64_t bits = device.PeekWindow();
+
+	// Gather the flag bit of every 9-bit slot into bits 0-5
+	const unsigned int flags = (unsigned int)(
+		((bits >> 63) & 0x01) | ((bits >> 53) & 0x02) | ((bits >> 43) & 0x04) |
+		((bits >> 33) & 0x08) | ((bits >> 23) & 0x10) | ((bits >> 13) & 0x20)
+		);
+	const unsigned int run = literal_run_length[flags];
+
+	uint8_t* dst = (out + out_i);
+	dst[0] = (uint8_t)(bits >> 55);
+	dst[1] = (uint8_t)(bits >> 46);
+	dst[2] = (uint8_t)(bits >> 37);
+	dst[3] = (uint8_t)(bits >> 28);
+	dst[4] = (uint8_t)(bits >> 19);
+	dst[5] = (uint8_t)(bits >> 10);
+	out_i += run;
+	device.Skip(run * 9);
+	return run;
+}
+
+// Results of decode_tokens()
+enum {
+	DECODE_OK,			// Reached [out_stop]
+	DECODE_NEED_INPUT,	// The next token isn't fully buffered yet
+	DECODE_SENTINEL,	// Read the end-of-stream offset
+	DECODE_CORRUPT		// Ran out of input, or a match ran past [out_end]
+};
+
+// Token loop shared by the whole-entry and streaming decoders. Decodes from
+// [device] into [out], starting at [out_i], until [out_i] reaches [out_stop].
+// Matches may run on past [out_stop] but never past [out_end], and at least
+// that much of [out] has to be writable. If [last] is set, [device] holds the
+// rest of the entry, and running out of it means the data is corrupt.
+//
+// Rather than keeping a separate dict ring, match offsets are resolved
+// against the already decoded output: byte [out_i] would sit at ring
+// position (out_i & LZSS_DICT_MASK), so each offset maps to a fixed
+// backwards distance of 1 to LZSS_DICT_SIZE bytes. Distances reaching
+// before the start of [out] read from the ring's zero fill.
+//
+// Instantiated for the 13- and 15-bit dicts of the actual formats, so that
+// the masks and token sizes become constants; a [FIXED_DICT_BITS] of 0
+// takes [dict_bits] at runtime instead.
+template <unsigned int FIXED_DICT_BITS>
+static int decode_tokens_impl(BitReader64& device, uint8_t* out, uint32_t& out_i,
+	const uint32_t out_stop, const uint32_t out_end, const bool last,
+	const unsigned int dict_bits)
+{
+	const unsigned int LZSS_DICT_BITS = FIXED_DICT_BITS ? FIXED_DICT_BITS : dict_bits;
 	const unsigned int LZSS_SEQ_BITS = 4;
 	const unsigned int LZSS_SEQ_MIN = 3;
 	const unsigned int LZSS_DICT_MASK = ((1 << LZSS_DICT_BITS) - 1);
 	const unsigned int LZSS_SEQ_MAX = (LZSS_SEQ_MIN + ((1 << LZSS_SEQ_BITS) - 1));
-	const unsigned int LZSS_DICT_SIZE = 1 << LZSS_DICT_BITS;
+	const unsigned int LZSS_TOKEN_BITS = (1 + LZSS_DICT_BITS + LZSS_SEQ_BITS);
+
+	// Fast loop. A word-sized refill always yields at least 57 bits, enough
+	// for a run of six literals or two tokens of any kind, so as long as
+	// another 8 bytes of input and room for two maximum-length matches
+	// (plus copy_match()'s overshoot) are left, neither side needs to be
+	// checked per token.
+	const uint32_t fast_room = (LZSS_SEQ_MAX + 24);
+	const uint32_t fast_stop = (out_end < fast_room) ? 0 :
+		((out_stop < (out_end - fast_room)) ? out_stop : (out_end - fast_room));
+	while ((out_i < fast_stop) && device.CanRefillFast()) {
+		device.RefillFast();
+
+		// Sound and music data is mostly literals, so take as many of them
+		// as one refill holds before falling back to single tokens
+		if (device.Peek(1)) {
+			decode_literal_run(device, out, out_i);
+			continue;
+		}
+		for (unsigned int t = 0; t < 2; ++t) {
+			if (device.Peek(1)) {
+				// Literal: flag bit plus 8 data bits
+				out[out_i++] = (uint8_t)device.Peek(9);
+				device.Skip(9);
+				continue;
+			}
 
-	// Textbook LZSS (from nmlgc's ssg)
-	BitReader device(fileData, compSize);
-	uint8_t* dict = new uint8_t[LZSS_DICT_SIZE];
+			// Match: flag bit, dictionary offset and sequence length
+			const uint32_t token = device.Peek(LZSS_TOKEN_BITS);
+			device.Skip(LZSS_TOKEN_BITS);
+			const uint32_t seq_offset = (token >> LZSS_SEQ_BITS);
+			if (seq_offset == 0) {
+				return DECODE_SENTINEL;
+			}
+			const unsigned int seq_length = (
+				(token & ((1 << LZSS_SEQ_BITS) - 1)) + LZSS_SEQ_MIN
+				);
+			const uint32_t distance = ((out_i - seq_offset) & LZSS_DICT_MASK) + 1;
+			output_match(out, out_i, distance, seq_length, fast_room);
+		}
+	}
+
+	// Careful loop for the last few bytes of input or output
+	while (out_i < out_stop) {
+		device.Refill();
+		const unsigned int token_bits = device.Peek(1) ? 9 : LZSS_TOKEN_BITS;
+		if ((device.BitsConsumed() + token_bits) > device.BitsInStream()) {
+			return last ? DECODE_CORRUPT : DECODE_NEED_INPUT;
+		}
+		if (token_bits == 9) {
+			out[out_i++] = (uint8_t)device.Peek(9);
+			device.Skip(9);
+			continue;
+		}
+
+		const uint32_t token = device.Peek(LZSS_TOKEN_BITS);
+		device.Skip(LZSS_TOKEN_BITS);
+		const uint32_t seq_offset = (token >> LZSS_SEQ_BITS);
+		if (seq_offset == 0) {
+			return DECODE_SENTINEL;
+		}
+		const unsigned int seq_length = (
+			(token & ((1 << LZSS_SEQ_BITS) - 1)) + LZSS_SEQ_MIN
+			);
+		if (seq_length > (out_end - out_i)) {
+			return DECODE_CORRUPT;
+		}
+		const uint32_t distance = ((out_i - seq_offset) & LZSS_DICT_MASK) + 1;
+		output_match(out, out_i, distance, seq_length, (out_end - out_i));
+	}
+	return DECODE_OK;
+}
+
+// Whether the coders for 13- and 15-bit dicts are used. Only lzssBench()
+// clears it, to time them against the ones reading the size at runtime.
+static bool specialised_dicts = true;
+
+static int decode_tokens(BitReader64& device, uint8_t* out, uint32_t& out_i,
+	const uint32_t out_stop, const uint32_t out_end, const bool last,
+	const unsigned int LZSS_DICT_BITS)
+{
+	switch (specialised_dicts ? LZSS_DICT_BITS : 0) {
+		case 13:
+			return decode_tokens_impl<13>(device, out, out_i, out_stop, out_end, last, LZSS_DICT_BITS);
+		case 15:
+			return decode_tokens_impl<15>(device, out, out_i, out_stop, out_end, last, LZSS_DICT_BITS);
+		default:
+			return decode_tokens_impl<0>(device, out, out_i, out_stop, out_end, last, LZSS_DICT_BITS);
+	}
+}
+
+// Generic LZSS decompression into a caller-provided buffer of [uncompSize]
+// bytes. Returns false if the data is corrupt, i.e. if it ends early, or
+// if it would decode to more than [uncompSize] bytes.
+// If [crc] is given, it receives the CRC32 of the decoded data, which is
+// updated every LZSS_CRC_BLOCK bytes while they are still in the cache
+// rather than in another pass over the whole buffer.
+// Uses 15 dict bits if PBG5 or later, or 13 if PBG4 or earlier
+bool decompress_into(const uint8_t* fileData, int compSize, uint8_t* uncompressed, int uncompSize, const unsigned int LZSS_DICT_BITS,
+	uint32_t* crc)
+{
+	// Textbook LZSS (from nmlgc's ssg), reading whole tokens at a time
+	BitReader64 device(fileData, compSize);
 	uint32_t out_i = 0;
 
-	memset(dict, 0, LZSS_DICT_SIZE);
+	if (!crc) {
+		return (decode_tokens(device, uncompressed, out_i, uncompSize, uncompSize,
+			true, LZSS_DICT_BITS) == DECODE_OK);
+	}
 
+	*crc = 0;
+	while (out_i < (uint32_t)uncompSize) {
+		const uint32_t block_start = out_i;
+		const uint32_t out_stop = ((uncompSize - out_i) < LZSS_CRC_BLOCK) ? uncompSize : (out_i + LZSS_CRC_BLOCK);
+		if (decode_tokens(device, uncompressed, out_i, out_stop, uncompSize,
+			true, LZSS_DICT_BITS) != DECODE_OK) {
+			return false;
+		}
+		*crc = crc32::update(*crc, uncompressed + block_start, out_i - block_start);
+	}
+	return true;
+}
+
+// Generic LZSS decompression into a newly allocated buffer, or NULL if the
+// data is corrupt
+uint8_t* decompress(uint8_t* fileData, int uncompSize, int compSize, const unsigned int LZSS_DICT_BITS)
+{
 	uint8_t* uncompressed = new uint8_t[uncompSize];
+	if (!decompress_into(fileData, compSize, uncompressed, uncompSize, LZSS_DICT_BITS)) {
+		delete[] uncompressed;
+		return NULL;
+	}
+	return uncompressed;
+}
+
+LZSSStream::LZSSStream()
+{
+	input = NULL;
+	window = NULL;
+	remaining = 0;
+	corrupt = false;
+}
+
+LZSSStream::~LZSSStream()
+{
+	delete[] input;
+	delete[] window;
+}
 
-	while (out_i < uncompSize) {
-		const bool is_literal = device.GetBit();
-		if (is_literal) {
-			output(device.GetBits(8), uncompressed, dict, out_i, LZSS_DICT_MASK);
+void LZSSStream::Begin(uint32_t uncompSize, const unsigned int dictBits)
+{
+	if (!window) {
+		input = new uint8_t[LZSS_STREAM_CHUNK + 8];
+		window = new uint8_t[(2 << 15) + LZSS_STREAM_BLOCK + 18];
+	}
+	dict_bits = dictBits;
+	remaining = uncompSize;
+	input_size = 0;
+	input_bit = 0;
+	input_last = false;
+	corrupt = false;
+
+	// The history in front of the output starts out as the zero-filled ring
+	out_i = (1 << dict_bits);
+	memset(window, 0, out_i);
+}
+
+void LZSSStream::Feed(const uint8_t* data, size_t size, bool last)
+{
+	// Drop the bytes that were fully consumed, keeping the partial one
+	const size_t consumed = (input_bit / 8);
+	memmove(input, input + consumed, input_size - consumed);
+	input_size -= consumed;
+	input_bit -= (consumed * 8);
+
+	memcpy(input + input_size, data, size);
+	input_size += size;
+	input_last = last;
+}
+
+const uint8_t* LZSSStream::Decode(size_t& size)
+{
+	const uint32_t dict_size = (1 << dict_bits);
+	size = 0;
+	if (Finished()) {
+		return NULL;
+	}
+
+	// Slide the last block's tail down to become the history for this one.
+	// Moving by whole multiples of the dict size keeps each byte's window
+	// index congruent to its ring position.
+	if (out_i >= (2 * dict_size)) {
+		const uint32_t shift = (((out_i - dict_size) / dict_size) * dict_size);
+		memmove(window, window + shift, out_i - shift);
+		out_i -= shift;
+	}
+	const uint32_t block_start = out_i;
+
+	const size_t start_byte = (input_bit / 8);
+	BitReader64 device(input + start_byte, input_size - start_byte);
+	device.Refill();
+	device.Skip(input_bit % 8);
+
+	// Tokens can run up to LZSS_SEQ_MAX bytes past the block
+	const uint32_t out_stop = block_start +
+		((remaining < LZSS_STREAM_BLOCK) ? remaining : LZSS_STREAM_BLOCK);
+	const uint32_t out_end = block_start +
+		((remaining < (LZSS_STREAM_BLOCK + 18)) ? remaining : (LZSS_STREAM_BLOCK + 18));
+	const int result = decode_tokens(device, window, out_i, out_stop, out_end, input_last, dict_bits);
+	input_bit = (start_byte * 8) + device.BitsConsumed();
+
+	// The sentinel can only show up before the end of the entry if data
+	// is missing
+	corrupt = ((result == DECODE_CORRUPT) || (result == DECODE_SENTINEL));
+
+	size = (out_i - block_start);
+	remaining -= size;
+	return (window + block_start);
+}
+
+bool LZSSDecoder::Extract(FILE* in, size_t compSize, FILE* out, uint32_t uncompSize, const unsigned int dictBits,
+	uint32_t* crc)
+{
+	if (uncompSize <= LZSS_STREAM_THRESHOLD) {
+		uint8_t* compressed = InputBuffer(compSize);
+		fread(compressed, compSize, 1, in);
+		uint8_t* uncompressed = OutputBuffer(uncompSize);
+		if (!decompress_into(compressed, compSize, uncompressed, uncompSize, dictBits, crc)) {
+			return false;
 		}
-		else {
-			uint32_t seq_offset = device.GetBits(LZSS_DICT_BITS);
-			if (seq_offset == 0) {
+		fwrite(uncompressed, uncompSize, 1, out);
+		return true;
+	}
+
+	uint8_t* chunk = InputBuffer(LZSS_STREAM_CHUNK);
+	stream.Begin(uncompSize, dictBits);
+	if (crc) {
+		*crc = 0;
+	}
+	while (!stream.Finished()) {
+		size_t blockSize = 0;
+		const uint8_t* block = stream.Decode(blockSize);
+		if (blockSize != 0) {
+			if (crc) {
+				*crc = crc32::update(*crc, block, blockSize);
+			}
+			fwrite(block, blockSize, 1, out);
+			continue;
+		}
+		if (compSize == 0) {
+			// Out of input without reaching the end of the entry
+			break;
+		}
+		const size_t chunkSize = (compSize < LZSS_STREAM_CHUNK) ? compSize : LZSS_STREAM_CHUNK;
+		fread(chunk, chunkSize, 1, in);
+		compSize -= chunkSize;
+		stream.Feed(chunk, chunkSize, (compSize == 0));
+	}
+
+	// The entry can end before all of its input has been read, with only
+	// the sentinel and padding left; skip those, so that [in] always ends
+	// up right after the entry
+	if (compSize != 0) {
+		fseek(in, (long)compSize, SEEK_CUR);
+	}
+	return (stream.Finished() && !stream.Corrupt());
+}
+
+// Bytes past the end of the encoder's dict that match_length() may read
+const unsigned int LZSS_MATCH_PAD = 32;
+
+static inline unsigned int count_trailing_zeros(uint32_t value)
+{
+#if defined(_MSC_VER) && (_MSC_VER >= 1400)
+	unsigned long index;
+	_BitScanForward(&index, value);
+	return index;
+#elif defined(__GNUC__)
+	return __builtin_ctz(value);
+#else
+	static const uint8_t debruijn[32] = {
+		0, 1, 28, 2, 29, 14, 24, 3, 30, 22, 20, 15, 25, 17, 4, 8,
+		31, 27, 13, 23, 21, 19, 16, 7, 26, 12, 18, 6, 11, 5, 10, 9
+	};
+	return debruijn[((value & (0 - value)) * 0x077CB531) >> 27];
+#endif
+}
+
+#ifdef PBGTK_SSE2
+// Whether match_length() compares 16 bytes at a time. Set before main(),
+// as the block-parallel encoder calls it from several threads.
+static const bool sse2 = cpu::has_sse2();
+#endif
+
+// Returns the length of the common prefix of [a] and [b], up to [limit]
+// bytes (at most LZSS_MATCH_PAD). Reads whole blocks, so up to
+// LZSS_MATCH_PAD bytes have to be readable from both pointers.
+static inline unsigned int match_length(const uint8_t* a, const uint8_t* b, const unsigned int limit)
+{
+	unsigned int len = 0;
+#ifdef PBGTK_SSE2
+	if (sse2) {
+		for (; len < limit; len += 16) {
+			const __m128i va = _mm_loadu_si128((const __m128i*)(a + len));
+			const __m128i vb = _mm_loadu_si128((const __m128i*)(b + len));
+			const uint32_t diff = (~_mm_movemask_epi8(_mm_cmpeq_epi8(va, vb)) & 0xFFFF);
+			if (diff != 0) {
+				len += count_trailing_zeros(diff);
 				break;
 			}
+		}
+		return (len < limit) ? len : limit;
+	}
+#endif
+	// XOR 8 bytes at a time, and find the first difference from the lowest
+	// set bit. The loads are little-endian on every target we build for.
+	for (; len < limit; len += 8) {
+		uint64_t wa;
+		uint64_t wb;
+		memcpy(&wa, a + len, 8);
+		memcpy(&wb, b + len, 8);
+		const uint64_t diff = (wa ^ wb);
+		if (diff != 0) {
+			const uint32_t low = (uint32_t)diff;
+			len += (low != 0)
+				? (count_trailing_zeros(low) / 8)
+				: (4 + (count_trailing_zeros((uint32_t)(diff >> 32)) / 8));
+			break;
+		}
+	}
+	return (len < limit) ? len : limit;
+}
+
+// State of the thtk LZSS encoder: the dict ring with its hash chains, and
+// how far into the input the lookahead has read. If [tree_son] is set, the
+// binary tree match finder is used instead of the ring and chains.
+struct lzss_encoder {
+	hash_t* hash;
+	unsigned char* dict;
+	unsigned int dict_head;
+	unsigned int dict_head_key;
+	unsigned int dict_head_run;
+	unsigned int waiting_bytes;
+	size_t bytes_read;
+	const uint8_t* input;
+	size_t input_size;
+	unsigned int dict_bits;
+	unsigned int dict_mask;
+
+	// Input position from which on the dict slot that gets overwritten
+	// holds an offset from this run, which has to leave its hash chain.
+	// Before that, the slot has never been added to a chain.
+	size_t remove_pos;
+
+	// How many positions in a row started with a run as long as the
+	// whole lookahead, and whether to leave most of those out of the
+	// chains
+	unsigned int run_count;
+	bool thin_runs;
+
+	uint32_t* tree_head;
+	uint32_t* tree_stamp;
+	uint32_t tree_epoch;
+	uint32_t* tree_son;
+	size_t tree_pos;
+	unsigned int tree_depth;
+};
+
+// The encoder's functions are instantiated for the 13- and 15-bit dicts of
+// the actual formats, so that the ring masks and token sizes become
+// constants. A [FIXED_DICT_BITS] of 0 takes them from the encoder instead.
+template <unsigned int FIXED_DICT_BITS>
+static inline unsigned int dict_mask(const lzss_encoder& enc)
+{
+	return FIXED_DICT_BITS ? ((1 << FIXED_DICT_BITS) - 1) : enc.dict_mask;
+}
+
+// Binary tree match finder, as in LZMA's bt3, working on the linear input
+// rather than the dict ring. [tree_head] holds the newest position with a
+// given hash of its first 3 bytes (if its [tree_stamp] is the
+// current [tree_epoch]), and [tree_son] holds a pair of
+// children for every position in the window. Each tree keeps its positions
+// sorted by their next LZSS_SEQ_MAX bytes, so a search only has to descend
+// about log2(window) levels to find the longest match, where a hash chain
+// has to visit every earlier occurrence of the key. Searching also inserts
+// the position at the root, so every position has to be passed through
+// here in order, whether a match is wanted there or not.
+// Positions are stored plus 1, leaving 0 as the null link.
+template <unsigned int FIXED_DICT_BITS>
+static unsigned int tree_insert(lzss_encoder& enc, unsigned int& match_offset)
+{
+	const unsigned int LZSS_SEQ_BITS = 4;
+	const unsigned int LZSS_SEQ_MIN = 3;
+	const unsigned int LZSS_SEQ_MAX = (LZSS_SEQ_MIN + ((1 << LZSS_SEQ_BITS) - 1));
+	const unsigned int LZSS_DICT_MASK = dict_mask<FIXED_DICT_BITS>(enc);
+	// Sources have to stay in the encoder's dict for the whole match
+	const size_t max_distance = (LZSS_DICT_MASK + 1) - LZSS_SEQ_MAX;
+
+	const size_t pos = enc.tree_pos++;
+	const uint8_t* cur = (enc.input + pos);
+	const size_t avail = (enc.input_size - pos);
+	const unsigned int len_limit = (avail < LZSS_SEQ_MAX) ? (unsigned int)avail : LZSS_SEQ_MAX;
+	unsigned int match_len = LZSS_SEQ_MIN - 1;
+
+	match_offset = 0;
+	if (len_limit < LZSS_SEQ_MIN) {
+		return match_len;
+	}
+
+	const unsigned int key = ((cur[1] << 8) | cur[2]) ^ (cur[0] << 4);
+	uint32_t cur_match = (enc.tree_stamp[key] == enc.tree_epoch) ? enc.tree_head[key] : 0;
+	enc.tree_head[key] = (uint32_t)(pos + 1);
+	enc.tree_stamp[key] = enc.tree_epoch;
+
+	uint32_t* ptr0 = enc.tree_son + ((pos & LZSS_DICT_MASK) << 1) + 1;
+	uint32_t* ptr1 = enc.tree_son + ((pos & LZSS_DICT_MASK) << 1);
+	unsigned int len0 = 0;
+	unsigned int len1 = 0;
+	unsigned int depth = enc.tree_depth;
+	for (;;) {
+		if ((cur_match == 0) || ((pos + 1 - cur_match) > max_distance) || (depth-- == 0)) {
+			*ptr0 = 0;
+			*ptr1 = 0;
+			break;
+		}
+		const size_t match_pos = (cur_match - 1);
+		uint32_t* pair = enc.tree_son + ((match_pos & LZSS_DICT_MASK) << 1);
+		const uint8_t* pb = (enc.input + match_pos);
+
+		// Everything in this subtree shares the shorter of the two bounds
+		unsigned int len = (len0 < len1) ? len0 : len1;
+		if (pb[len] == cur[len]) {
+			while ((++len != len_limit) && (pb[len] == cur[len]))
+				;
+
+			// Ring slot 0 holds the sentinel offset, so the position that
+			// lands there can't be referenced
+			const unsigned int offset = ((match_pos + 1) & LZSS_DICT_MASK);
+			if ((len > match_len) && (offset != 0)) {
+				match_len = len;
+				match_offset = offset;
+			}
+			if (len == len_limit) {
+				// Identical as far as the tree cares, so this position
+				// takes over the node's children
+				*ptr1 = pair[0];
+				*ptr0 = pair[1];
+				break;
+			}
+		}
+		if (pb[len] < cur[len]) {
+			*ptr1 = cur_match;
+			ptr1 = (pair + 1);
+			cur_match = *ptr1;
+			len1 = len;
+		}
+		else {
+			*ptr0 = cur_match;
+			ptr0 = pair;
+			cur_match = *ptr0;
+			len0 = len;
+		}
+	}
+	return match_len;
+}
+
+// Walks up to [max_chain] entries of the hash chain at the dict head, or
+// searches the binary tree. Returns the length of the longest match, which
+// is less than LZSS_SEQ_MIN if there is none, and stores its offset in
+// [match_offset]. Has to be called at most once per position.
+template <unsigned int FIXED_DICT_BITS>
+static unsigned int find_match(lzss_encoder& enc, unsigned int max_chain, unsigned int& match_offset)
+{
+	if (enc.tree_son) {
+		return tree_insert<FIXED_DICT_BITS>(enc, match_offset);
+	}
+
+	const unsigned int LZSS_SEQ_MIN = 3;
+	const unsigned int LZSS_SEQ_BITS = 4;
+	const unsigned int LZSS_SEQ_MAX = (LZSS_SEQ_MIN + ((1 << LZSS_SEQ_BITS) - 1));
+	const unsigned int LZSS_DICT_MASK = dict_mask<FIXED_DICT_BITS>(enc);
+	const unsigned int LZSS_DICT_SIZE = (LZSS_DICT_MASK + 1);
+	const unsigned char* dict = enc.dict;
+	const unsigned int dict_head = enc.dict_head;
+	const unsigned int len_limit = enc.waiting_bytes;
+	unsigned int match_len = LZSS_SEQ_MIN - 1;
+	unsigned int offset;
+	unsigned int i;
+
+	// Candidates are compared in blocks as long as neither side wraps
+	// around the end of the ring
+	const bool head_linear = ((dict_head + len_limit) <= LZSS_DICT_SIZE);
+
+	match_offset = 0;
+
+	// Inside a run of one byte, the previous byte starts a match as long
+	// as the rest of the run. That is as good as any match of the same
+	// length, and if it fills the lookahead, there is nothing left to
+	// search for. The slot before the head has always been written,
+	// except for slot 0 at the very start, which can't be referenced.
+	// At the start of a run, the chain only holds candidates whose run is
+	// exactly as long. Of the others, one with a longer run matches as far
+	// as this one goes, or else one with the longest shorter run does. The
+	// newest of each length will do, so their chains are only walked past
+	// hash collisions.
+	const unsigned int run = (enc.dict_head_run < len_limit) ? enc.dict_head_run : len_limit;
+	if (run >= LZSS_SEQ_MIN) {
+		const unsigned char byte = dict[dict_head];
+		unsigned int len = run;
+		offset = (dict_head - 1) & LZSS_DICT_MASK;
+		if ((offset == 0) || (dict[offset] != byte)) {
+			offset = 0;
+			for (unsigned int other = LZSS_SEQ_MAX; (other >= LZSS_SEQ_MIN) && (offset == 0); --other) {
+				if (other == enc.dict_head_run) {
+					continue;
+				}
+				len = (other < run) ? other : run;
+				unsigned int chain = max_chain;
+				i = 0;
+				for (offset = list_head(enc.hash, run_key(byte, other)); offset != 0;
+					offset = list_next(enc.hash, offset)) {
+					for (i = 0; (i < len) && (dict[(offset + i) & LZSS_DICT_MASK] == byte); ++i)
+						;
+					if ((i == len) || (--chain == 0))
+						break;
+				}
+				if (i != len) {
+					offset = 0;
+				}
+			}
+		}
+		if (offset != 0) {
+			match_len = len;
+			match_offset = offset;
+			if (match_len == len_limit) {
+				return match_len;
+			}
+		}
+	}
+
+	for (offset = list_head(enc.hash, enc.dict_head_key);
+		offset != 0 && enc.waiting_bytes > match_len && max_chain != 0;
+		offset = list_next(enc.hash, offset), --max_chain) {
+		// First, check a character further ahead to see if this match can
+		// be any longer than the current match
+		if (dict[(dict_head + match_len) & LZSS_DICT_MASK] ==
+			dict[(offset + match_len) & LZSS_DICT_MASK]) {
+			if (head_linear && ((offset + len_limit) <= LZSS_DICT_SIZE)) {
+				const unsigned int len = match_length(dict + dict_head, dict + offset, len_limit);
+				if (len > match_len) {
+					match_len = len;
+					match_offset = offset;
+				}
+				continue;
+			}
+
+			// Then check the previous characters
+			for (i = 0;
+				i < match_len &&
+				(dict[(dict_head + i) & LZSS_DICT_MASK] ==
+					dict[(offset + i) & LZSS_DICT_MASK]);
+					++i)
+				;
+
+			if (i < match_len)
+				continue;
+
+			// Finally, try to extend the match
+			for (++match_len;
+				match_len < enc.waiting_bytes &&
+				(dict[(dict_head + match_len) & LZSS_DICT_MASK] ==
+					dict[(offset + match_len) & LZSS_DICT_MASK]);
+				++match_len)
+				;
+
+			match_offset = offset;
+		}
+	}
+	return match_len;
+}
+
+// Moves the dict head forward by [count] bytes, adding the bytes it passes
+// to the hash chains and reading as many new ones into the lookahead.
+// Positions that start with a run filling the whole lookahead all look the
+// same, so with [thin_runs], only the first LZSS_RUN_INSERT of every
+// LZSS_RUN_PERIOD of them in a row are added, just to keep some in the
+// window. Within the run, find_match() gets its matches from the byte right
+// before the head.
+template <unsigned int FIXED_DICT_BITS>
+static void advance_dict(lzss_encoder& enc, const unsigned int count)
+{
+	const unsigned int LZSS_SEQ_MIN = 3;
+	const unsigned int LZSS_SEQ_BITS = 4;
+	const unsigned int LZSS_SEQ_MAX = (LZSS_SEQ_MIN + ((1 << LZSS_SEQ_BITS) - 1));
+	const unsigned int LZSS_DICT_MASK = dict_mask<FIXED_DICT_BITS>(enc);
+	const unsigned int LZSS_RUN_INSERT = 4;
+	const unsigned int LZSS_RUN_PERIOD = 0x1000;
+
+	if (enc.tree_son) {
+		// Only the input position matters here, but the tree still needs
+		// to see every position that find_match() wasn't called on
+		for (unsigned int i = 0; i < count; ++i) {
+			const size_t pos = (enc.bytes_read - enc.waiting_bytes);
+			if (enc.tree_pos == pos) {
+				unsigned int match_offset;
+				tree_insert<FIXED_DICT_BITS>(enc, match_offset);
+			}
+			if (enc.bytes_read < enc.input_size) {
+				++enc.bytes_read;
+			}
 			else {
-				--seq_offset;
+				--enc.waiting_bytes;
 			}
-			const unsigned int seq_length = (
-				device.GetBits(LZSS_SEQ_BITS) + LZSS_SEQ_MIN
-				);
-			for (unsigned int i = 0; i < seq_length; ++i) {
-				output(dict[seq_offset++ & LZSS_DICT_MASK], uncompressed, dict, out_i, LZSS_DICT_MASK);
+		}
+		return;
+	}
+
+	for (unsigned int i = 0; i < count; ++i) {
+		const unsigned int offset =
+			(enc.dict_head + LZSS_SEQ_MAX) & LZSS_DICT_MASK;
+
+		if (offset != 0 && (enc.bytes_read - enc.waiting_bytes) >= enc.remove_pos)
+			list_remove(enc.hash, enc.dict, offset, LZSS_DICT_MASK);
+
+		const bool full_run = ((enc.dict_head_run == LZSS_SEQ_MAX) && (enc.waiting_bytes == LZSS_SEQ_MAX));
+		if (!full_run) {
+			enc.run_count = 0;
+		}
+		if (enc.dict_head != 0) {
+			if (!full_run || !enc.thin_runs || ((enc.run_count++ % LZSS_RUN_PERIOD) < LZSS_RUN_INSERT))
+				list_add(enc.hash, enc.dict_head_key, enc.dict_head);
+			else
+				list_skip(enc.hash, enc.dict_head);
+		}
+
+		if (enc.bytes_read < enc.input_size) {
+			enc.dict[offset] = enc.input[enc.bytes_read];
+			++enc.bytes_read;
+		}
+		else {
+			--enc.waiting_bytes;
+		}
+
+		enc.dict_head = (enc.dict_head + 1) & LZSS_DICT_MASK;
+		// A run that filled the lookahead still does if the new byte
+		// continues it
+		if (full_run && (enc.waiting_bytes == LZSS_SEQ_MAX) && (enc.dict[offset] == enc.dict[enc.dict_head]))
+			continue;
+		enc.dict_head_key = generate_key(enc.dict, enc.dict_head, LZSS_DICT_MASK, enc.dict_head_run);
+	}
+}
+
+// Like advance_dict(), but leaves the bytes it passes out of the hash chains
+// or tree, so they can't be matched later on. Used to get through data that
+// doesn't compress quickly.
+template <unsigned int FIXED_DICT_BITS>
+static void skip_dict(lzss_encoder& enc, const unsigned int count)
+{
+	const unsigned int LZSS_SEQ_MIN = 3;
+	const unsigned int LZSS_SEQ_BITS = 4;
+	const unsigned int LZSS_SEQ_MAX = (LZSS_SEQ_MIN + ((1 << LZSS_SEQ_BITS) - 1));
+	const unsigned int LZSS_DICT_MASK = dict_mask<FIXED_DICT_BITS>(enc);
+
+	if (enc.tree_son) {
+		for (unsigned int i = 0; i < count; ++i) {
+			const size_t pos = (enc.bytes_read - enc.waiting_bytes);
+			if (enc.tree_pos == pos) {
+				++enc.tree_pos;
+			}
+			if (enc.bytes_read < enc.input_size) {
+				++enc.bytes_read;
+			}
+			else {
+				--enc.waiting_bytes;
 			}
 		}
+		return;
 	}
 
+	for (unsigned int i = 0; i < count; ++i) {
+		const unsigned int offset =
+			(enc.dict_head + LZSS_SEQ_MAX) & LZSS_DICT_MASK;
+
+		if (offset != 0 && (enc.bytes_read - enc.waiting_bytes) >= enc.remove_pos)
+			list_remove(enc.hash, enc.dict, offset, LZSS_DICT_MASK);
+
+		list_skip(enc.hash, enc.dict_head);
+
+		if (enc.bytes_read < enc.input_size) {
+			enc.dict[offset] = enc.input[enc.bytes_read];
+			++enc.bytes_read;
+		}
+		else {
+			--enc.waiting_bytes;
+		}
+
+		enc.dict_head = (enc.dict_head + 1) & LZSS_DICT_MASK;
+	}
+	enc.dict_head_key = generate_key(enc.dict, enc.dict_head, LZSS_DICT_MASK, enc.dict_head_run);
+}
+
+// Match search settings for each LZSSLevel. With [skip_literals], long
+// stretches without any matches are searched more and more sparsely.
+static const struct {
+	unsigned int max_chain;
+	bool lazy;
+	bool skip_literals;
+} lzss_levels[] = {
+	{ 8, false, true },				// LZSS_LEVEL_FAST
+	{ 1024, true, true },			// LZSS_LEVEL_DEFAULT
+	{ 0xFFFFFFFF, true, false },	// LZSS_LEVEL_MAX
+	{ 0xFFFFFFFF, false, false }	// LZSS_LEVEL_OPTIMAL
+};
+
+// Greedy or one-step lazy parsing, deciding on each token as soon as it is
+// found
+template <unsigned int FIXED_DICT_BITS>
+static void parse_lazy(lzss_encoder& enc, BitWriter& device, const int level)
+{
+	const unsigned int LZSS_DICT_BITS = FIXED_DICT_BITS ? FIXED_DICT_BITS : enc.dict_bits;
+	const unsigned int LZSS_SEQ_BITS = 4;
+	const unsigned int LZSS_SEQ_MIN = 3;
+	const unsigned int LZSS_SEQ_MAX = (LZSS_SEQ_MIN + ((1 << LZSS_SEQ_BITS) - 1));
+	// Miss count from which on positions are skipped, one more for every
+	// further LZSS_SKIP_START misses up to LZSS_SKIP_MAX, and how many
+	// misses each matched byte makes up for
+	const unsigned int LZSS_SKIP_START = 256;
+	const unsigned int LZSS_SKIP_MAX = 32;
+	const unsigned int LZSS_SKIP_CREDIT = 16;
+	const unsigned int max_chain = lzss_levels[level].max_chain;
+	const bool lazy = lzss_levels[level].lazy;
+	const unsigned int skip_start = lzss_levels[level].skip_literals ? LZSS_SKIP_START : 0xFFFFFFFF;
+
+	// Running estimate of how badly the recent input matches. Grows by one
+	// for every literal, and is halved and reduced for every match, so the
+	// occasional chance match in random data doesn't reset it, while a
+	// compressible stretch quickly brings it back down.
+	unsigned int misses = 0;
+
+	unsigned int match_offset = 0;
+	unsigned int match_len = find_match<FIXED_DICT_BITS>(enc, max_chain, match_offset);
+	while (enc.waiting_bytes) {
+		if (match_len < LZSS_SEQ_MIN) {
+			const uint8_t* literal = (enc.input + enc.bytes_read - enc.waiting_bytes);
+			device.PutBits(0x100 | literal[0], 9);
+			advance_dict<FIXED_DICT_BITS>(enc, 1);
+
+			// Data that hasn't matched for a while probably won't match
+			// in the next few bytes either, so write those as literals
+			// right away, skipping further ahead the longer this goes on.
+			// Searches still happen in between, to find the next
+			// compressible stretch.
+			if (++misses >= skip_start) {
+				unsigned int skip = (misses / LZSS_SKIP_START);
+				if (skip > LZSS_SKIP_MAX) {
+					skip = LZSS_SKIP_MAX;
+				}
+				if (skip > enc.waiting_bytes) {
+					skip = enc.waiting_bytes;
+				}
+				unsigned int i = 1;
+				for (; (i + 2) <= skip; i += 3) {
+					device.PutBits(
+						(0x4020100 | (literal[i] << 18) | (literal[i + 1] << 9) | literal[i + 2]), 27
+					);
+				}
+				for (; i <= skip; ++i) {
+					device.PutBits(0x100 | literal[i], 9);
+				}
+				skip_dict<FIXED_DICT_BITS>(enc, skip);
+				misses += skip;
+				if (misses > (LZSS_SKIP_START * LZSS_SKIP_MAX)) {
+					misses = (LZSS_SKIP_START * LZSS_SKIP_MAX);
+				}
+			}
+			match_len = find_match<FIXED_DICT_BITS>(enc, max_chain, match_offset);
+			continue;
+		}
+
+		unsigned int skip = match_len;
+		if (lazy && (match_len < LZSS_SEQ_MAX)) {
+			// One-step lazy matching: if the next byte starts a longer match,
+			// write this one as a literal and take that match instead
+			const uint8_t literal = enc.input[enc.bytes_read - enc.waiting_bytes];
+			advance_dict<FIXED_DICT_BITS>(enc, 1);
+			unsigned int next_offset = 0;
+			const unsigned int next_len = find_match<FIXED_DICT_BITS>(enc, max_chain, next_offset);
+			if (next_len > match_len) {
+				device.PutBit(1);
+				device.PutBits(literal, 8);
+				match_len = next_len;
+				match_offset = next_offset;
+				continue;
+			}
+			--skip;
+		}
+
+		misses /= 2;
+		misses = (misses > (match_len * LZSS_SKIP_CREDIT)) ? (misses - (match_len * LZSS_SKIP_CREDIT)) : 0;
+
+		// The match always refers to the dict as it was at its own start,
+		// which is also how the decoder will see it
+		device.PutBit(0);
+		device.PutBits(match_offset, LZSS_DICT_BITS);
+		device.PutBits(match_len - LZSS_SEQ_MIN, 4);
+		advance_dict<FIXED_DICT_BITS>(enc, skip);
+		match_len = find_match<FIXED_DICT_BITS>(enc, max_chain, match_offset);
+	}
+}
+
+// Price-based optimal parsing. The dict and hash chains only depend on the
+// input position, not on the tokens chosen, so the longest match at every
+// position can be found up front. Any prefix of a match of 3 bytes or more
+// is a match as well, and every token has a fixed cost, so a backwards pass
+// over those matches then finds the cheapest sequence of tokens exactly.
+// To bound memory use, this runs on windows of LZSS_OPTIMAL_BLOCK bytes.
+// The last LZSS_OPTIMAL_TAIL bytes of each window, where cutting matches off
+// at its end could still change the choice, are held back for the next one.
+// Returns the number of bits greedy parsing would have written instead.
+template <unsigned int FIXED_DICT_BITS>
+static uint64_t parse_optimal(lzss_encoder& enc, BitWriter& device)
+{
+	const unsigned int LZSS_DICT_BITS = FIXED_DICT_BITS ? FIXED_DICT_BITS : enc.dict_bits;
+	const unsigned int LZSS_OPTIMAL_BLOCK = 0x10000;
+	const unsigned int LZSS_OPTIMAL_TAIL = 0x1000;
+	const unsigned int LZSS_SEQ_BITS = 4;
+	const unsigned int LZSS_SEQ_MIN = 3;
+	const unsigned int LZSS_LITERAL_BITS = 9;
+	const unsigned int LZSS_MATCH_BITS = (1 + LZSS_DICT_BITS + LZSS_SEQ_BITS);
+
+	std::vector<uint8_t> lengths(LZSS_OPTIMAL_BLOCK);
+	std::vector<uint16_t> offsets(LZSS_OPTIMAL_BLOCK);
+	std::vector<uint8_t> choices(LZSS_OPTIMAL_BLOCK);
+	std::vector<uint32_t> costs(LZSS_OPTIMAL_BLOCK + 1);
+	uint64_t greedy_bits = 0;
+	unsigned int greedy_skip = 0;
+	unsigned int block_size = 0;
+
+	for (;;) {
+		// Input position of the first byte in the window
+		const size_t block_pos = (enc.bytes_read - enc.waiting_bytes - block_size);
+		while (enc.waiting_bytes && (block_size < LZSS_OPTIMAL_BLOCK)) {
+			unsigned int match_offset = 0;
+			const unsigned int match_len = find_match<FIXED_DICT_BITS>(enc, 0xFFFFFFFF, match_offset);
+			lengths[block_size] = (uint8_t)match_len;
+			offsets[block_size] = (uint16_t)match_offset;
+
+			// Keep track of what the greedy parse would have done
+			if (greedy_skip == 0) {
+				if (match_len >= LZSS_SEQ_MIN) {
+					greedy_bits += LZSS_MATCH_BITS;
+					greedy_skip = match_len;
+				}
+				else {
+					greedy_bits += LZSS_LITERAL_BITS;
+					greedy_skip = 1;
+				}
+			}
+			--greedy_skip;
+
+			advance_dict<FIXED_DICT_BITS>(enc, 1);
+			++block_size;
+		}
+		const bool last = (enc.waiting_bytes == 0);
+
+		// Cheapest cost from each position to the end of the window, taking
+		// the longest match on ties to keep the token count down
+		costs[block_size] = 0;
+		for (unsigned int i = block_size; i-- > 0;) {
+			unsigned int max_len = lengths[i];
+			if (max_len > (block_size - i)) {
+				max_len = (block_size - i);
+			}
+			uint32_t best_cost = (costs[i + 1] + LZSS_LITERAL_BITS);
+			unsigned int best_len = 1;
+			for (unsigned int len = max_len; len >= LZSS_SEQ_MIN; --len) {
+				const uint32_t cost = (costs[i + len] + LZSS_MATCH_BITS);
+				if ((cost < best_cost) || ((best_len == 1) && (cost == best_cost))) {
+					best_cost = cost;
+					best_len = len;
+				}
+			}
+			costs[i] = best_cost;
+			choices[i] = (uint8_t)best_len;
+		}
+
+		const unsigned int emit_end = last ? block_size : (block_size - LZSS_OPTIMAL_TAIL);
+		unsigned int i = 0;
+		for (; i < emit_end; i += choices[i]) {
+			if (choices[i] == 1) {
+				device.PutBit(1);
+				device.PutBits(enc.input[block_pos + i], 8);
+			}
+			else {
+				device.PutBit(0);
+				device.PutBits(offsets[i], LZSS_DICT_BITS);
+				device.PutBits(choices[i] - LZSS_SEQ_MIN, 4);
+			}
+		}
+		if (last) {
+			break;
+		}
+
+		// Move the held back matches to the front of the window
+		memmove(&lengths[0], &lengths[i], (block_size - i) * sizeof(lengths[0]));
+		memmove(&offsets[0], &offsets[i], (block_size - i) * sizeof(offsets[0]));
+		block_size -= i;
+	}
+	return greedy_bits;
+}
+
+// Primes the encoder with the first [prime_count] bytes of its input, then
+// encodes the rest with the parser for [level]. Returns the number of bits
+// greedy parsing would have written for LZSS_LEVEL_OPTIMAL.
+template <unsigned int FIXED_DICT_BITS>
+static uint64_t encode_tokens(lzss_encoder& enc, BitWriter& device, const int level, const unsigned int prime_count)
+{
+	// The dict and match finder only depend on the input position, so
+	// running them over the preceding input leaves them in the same state
+	// as if it had been encoded
+	advance_dict<FIXED_DICT_BITS>(enc, prime_count);
+
+	if (level == LZSS_LEVEL_OPTIMAL) {
+		return parse_optimal<FIXED_DICT_BITS>(enc, device);
+	}
+	parse_lazy<FIXED_DICT_BITS>(enc, device, level);
+	return 0;
+}
+
+LZSSEncoder::LZSSEncoder()
+{
+	dictBits = 0;
+	dict = NULL;
+	hash = NULL;
+	treeHead = NULL;
+	treeStamp = NULL;
+	treeSon = NULL;
+	treeEpoch = 0;
+}
+
+LZSSEncoder::~LZSSEncoder()
+{
 	delete[] dict;
-	return uncompressed;
+	delete hash;
+	delete[] treeHead;
+	delete[] treeStamp;
+	delete[] treeSon;
 }
 
-// Generic (optimized from thtk) LZSS compression
-// Uses 15 dict bits if PBG5 or later, or 13 if PBG4 or earlier
-std::vector<uint8_t> compress(uint8_t* fileData, int size, const unsigned int LZSS_DICT_BITS)
+void LZSSEncoder::Prepare(const unsigned int bits, const int options)
+{
+	const unsigned int LZSS_DICT_SIZE = 1 << bits;
+
+	if (dictBits != bits) {
+		delete[] dict;
+		delete hash;
+		delete[] treeSon;
+		dict = new uint8_t[LZSS_DICT_SIZE + LZSS_MATCH_PAD];
+		hash = new hash_t(LZSS_DICT_SIZE);
+		treeSon = NULL;
+		dictBits = bits;
+	}
+	if ((options & LZSS_FINDER_TREE) && !treeHead) {
+		treeHead = new uint32_t[0x10000];
+		treeStamp = new uint32_t[0x10000];
+		memset(treeStamp, 0, 0x10000 * sizeof(uint32_t));
+	}
+	if ((options & LZSS_FINDER_TREE) && !treeSon) {
+		treeSon = new uint32_t[LZSS_DICT_SIZE * 2];
+	}
+
+	hash->NextEpoch();
+	if (treeHead && (++treeEpoch == 0)) {
+		memset(treeStamp, 0, 0x10000 * sizeof(uint32_t));
+		treeEpoch = 1;
+	}
+}
+
+// Matches never reach past [end]. If [begin] isn't 0, the dict and match
+// finder are first primed with up to one dict of the input in front of it,
+// at the same ring positions the decoder will have it at.
+uint64_t LZSSEncoder::CompressRange(const uint8_t* fileData, size_t begin, size_t end,
+	const unsigned int LZSS_DICT_BITS, const int options, BitWriter& device)
 {
+	const int level = (options & LZSS_LEVEL_MASK);
 	const unsigned int LZSS_SEQ_BITS = 4;
 	const unsigned int LZSS_SEQ_MIN = 3;
 	const unsigned int LZSS_DICT_MASK = ((1 << LZSS_DICT_BITS) - 1);
 	const unsigned int LZSS_SEQ_MAX = (LZSS_SEQ_MIN + ((1 << LZSS_SEQ_BITS) - 1));
 	const unsigned int LZSS_DICT_SIZE = 1 << LZSS_DICT_BITS;
+	const size_t prime = (begin > LZSS_DICT_SIZE) ? (begin - LZSS_DICT_SIZE) : 0;
+
+	Prepare(LZSS_DICT_BITS, options);
 
 	// thtk LZSS implementation
-	BitWriter device;
-	hash_t hash(LZSS_DICT_SIZE);
-	unsigned char* dict = new unsigned char[LZSS_DICT_SIZE];
-	unsigned int dict_head = 1;
-	unsigned int dict_head_key = 0;
-	unsigned int waiting_bytes = 0;
-	size_t bytes_read = 0;
+	// Nothing but the lookahead has to be cleared in the dict, as matches
+	// only ever start at slots that have been written in this run
+	lzss_encoder enc;
+	enc.hash = hash;
+	enc.dict = dict;
+	enc.dict_head = ((prime + 1) & LZSS_DICT_MASK);
+	enc.waiting_bytes = 0;
+	enc.bytes_read = prime;
+	enc.input = fileData;
+	enc.input_size = end;
+	enc.dict_bits = LZSS_DICT_BITS;
+	enc.dict_mask = LZSS_DICT_MASK;
+	enc.remove_pos = (prime + LZSS_DICT_SIZE - LZSS_SEQ_MAX);
+	enc.run_count = 0;
+	// Leaving run positions out can cost a candidate that a later search
+	// would have found, so the levels that walk the whole chain keep them
+	enc.thin_runs = (level < LZSS_LEVEL_MAX);
+	enc.tree_head = NULL;
+	enc.tree_stamp = NULL;
+	enc.tree_epoch = treeEpoch;
+	enc.tree_son = NULL;
+	enc.tree_pos = prime;
+	enc.tree_depth = lzss_levels[level].max_chain;
+	if (options & LZSS_FINDER_TREE) {
+		enc.tree_head = treeHead;
+		enc.tree_stamp = treeStamp;
+		enc.tree_son = treeSon;
+	}
 	unsigned int i = 0;
 
-	memset(dict, 0, sizeof(unsigned char) * LZSS_DICT_SIZE);
-
 	// Fill the forward-looking buffer
-	for (i = 0; i < LZSS_SEQ_MAX && i < size; ++i) {
-		dict[dict_head + i] = fileData[bytes_read];
-		++bytes_read;
-		++waiting_bytes;
-	}
-
-	dict_head_key = generate_key(dict, dict_head, LZSS_DICT_MASK);
-
-	while (waiting_bytes) {
-		unsigned int match_len = LZSS_SEQ_MIN - 1;
-		unsigned int match_offset = 0;
-		unsigned int offset;
-
-		// Find a good match
-		for (offset = hash.hash[dict_head_key];
-			offset != 0 && waiting_bytes > match_len;
-			offset = hash.next[offset]) {
-			// First, check a character further ahead to see if this match can
-			// be any longer than the current match
-			if (dict[(dict_head + match_len) & LZSS_DICT_MASK] ==
-				dict[(offset + match_len) & LZSS_DICT_MASK]) {
-				// Then check the previous characters
-				for (i = 0;
-					i < match_len &&
-					(dict[(dict_head + i) & LZSS_DICT_MASK] ==
-						dict[(offset + i) & LZSS_DICT_MASK]);
-						++i)
-					;
-
-				if (i < match_len)
-					continue;
+	for (i = 0; i < LZSS_SEQ_MAX; ++i) {
+		uint8_t byte = 0;
+		if ((prime + i) < end) {
+			byte = fileData[enc.bytes_read];
+			++enc.bytes_read;
+			++enc.waiting_bytes;
+		}
+		enc.dict[(enc.dict_head + i) & LZSS_DICT_MASK] = byte;
+	}
 
-				// Finally, try to extend the match
-				for (++match_len;
-					match_len < waiting_bytes &&
-					(dict[(dict_head + match_len) & LZSS_DICT_MASK] ==
-						dict[(offset + match_len) & LZSS_DICT_MASK]);
-					++match_len)
-					;
+	enc.dict_head_key = generate_key(enc.dict, enc.dict_head, LZSS_DICT_MASK, enc.dict_head_run);
 
-				match_offset = offset;
-			}
-		}
+	switch (specialised_dicts ? LZSS_DICT_BITS : 0) {
+		case 13:
+			return encode_tokens<13>(enc, device, level, (unsigned int)(begin - prime));
+		case 15:
+			return encode_tokens<15>(enc, device, level, (unsigned int)(begin - prime));
+		default:
+			return encode_tokens<0>(enc, device, level, (unsigned int)(begin - prime));
+	}
+}
 
-		// Write data to the output buffer
-		if (match_len < LZSS_SEQ_MIN) {
-			match_len = 1;
-			device.PutBit(1);
-			device.PutBits(dict[dict_head], 8);
-		}
-		else {
-			device.PutBit(0);
-			device.PutBits(match_offset, LZSS_DICT_BITS);
-			device.PutBits(match_len - LZSS_SEQ_MIN, 4);
-		}
+// One block of a block-parallel compress()
+struct lzss_block {
+	size_t begin;
+	size_t end;
+	BitWriter device;
+	uint64_t greedy_bits;
+};
 
-		// Add bytes to the dictionary
-		for (i = 0; i < match_len; ++i) {
-			const unsigned int offset =
-				(dict_head + LZSS_SEQ_MAX) & LZSS_DICT_MASK;
+// Blocks [first], [first] + [step], [first] + 2 * [step], ... of
+// [blocks], for one thread of a block-parallel compress(). Uses [encoder]
+// if given, or a context of its own otherwise.
+struct lzss_block_thread {
+	std::vector<lzss_block>* blocks;
+	size_t first;
+	size_t step;
+	const uint8_t* fileData;
+	unsigned int dict_bits;
+	int options;
+	LZSSEncoder* encoder;
+};
 
-			if (offset != 0)
-				list_remove(&hash, generate_key(dict, offset, LZSS_DICT_MASK), offset);
-			if (dict_head != 0)
-				list_add(&hash, dict_head_key, dict_head);
+static DWORD WINAPI compress_blocks(LPVOID param)
+{
+	lzss_block_thread& thread = *(lzss_block_thread*)param;
+	std::vector<lzss_block>& blocks = *thread.blocks;
+	LZSSEncoder own;
+	LZSSEncoder& encoder = thread.encoder ? *thread.encoder : own;
+	for (size_t i = thread.first; i < blocks.size(); i += thread.step) {
+		lzss_block& block = blocks[i];
+		block.device.Reserve((((block.end - block.begin) * 9) / 8) + 8);
+		block.greedy_bits = encoder.CompressRange(thread.fileData, block.begin, block.end, thread.dict_bits,
+			thread.options, block.device);
+	}
+	return 0;
+}
 
-			if (bytes_read < size) {
-				dict[offset] = fileData[bytes_read];
-				++bytes_read;
+// Generic (optimized from thtk) LZSS compression
+// Uses 15 dict bits if PBG5 or later, or 13 if PBG4 or earlier
+// With LZSS_LEVEL_OPTIMAL, [greedySize] (if given) receives the size that
+// greedy parsing would have produced, taking the longest match over the
+// whole chain wherever one starts. This is not any of the levels, all of
+// which give up the search early, and packs smaller than LZSS_LEVEL_DEFAULT
+// does. With any other level, it is just the output size.
+std::vector<uint8_t> LZSSEncoder::Compress(uint8_t* fileData, int size, const unsigned int LZSS_DICT_BITS,
+	const int options, size_t* greedySize)
+{
+	const int level = (options & LZSS_LEVEL_MASK);
+	const size_t block_size = ((size_t)((unsigned int)options >> LZSS_BLOCK_SHIFT) * 1024);
+
+	// Every byte costs at most 9 bits, plus room for the sentinel
+	BitWriter device;
+	device.Reserve((((size_t)size * 9) / 8) + 8);
+
+	uint64_t greedy_bits = 0;
+	if ((block_size == 0) || ((size_t)size <= block_size)) {
+		greedy_bits = CompressRange(fileData, 0, size, LZSS_DICT_BITS, options, device);
+	}
+	else {
+		std::vector<lzss_block> blocks((size + block_size - 1) / block_size);
+		for (size_t i = 0; i < blocks.size(); ++i) {
+			blocks[i].begin = (i * block_size);
+			blocks[i].end = (i + 1 < blocks.size()) ? ((i + 1) * block_size) : size;
+			blocks[i].greedy_bits = 0;
+		}
+
+		// Blocks are dealt out round-robin rather than taken from a shared
+		// counter, so the threads never have to synchronize
+		SYSTEM_INFO info;
+		GetSystemInfo(&info);
+		size_t thread_count = info.dwNumberOfProcessors;
+		if (thread_count > blocks.size()) {
+			thread_count = blocks.size();
+		}
+		if (thread_count > MAXIMUM_WAIT_OBJECTS) {
+			thread_count = MAXIMUM_WAIT_OBJECTS;
+		}
+		if (thread_count < 1) {
+			thread_count = 1;
+		}
+		std::vector<lzss_block_thread> threads(thread_count);
+		std::vector<HANDLE> handles;
+		for (size_t i = 0; i < thread_count; ++i) {
+			threads[i].blocks = &blocks;
+			threads[i].first = i;
+			threads[i].step = thread_count;
+			threads[i].fileData = fileData;
+			threads[i].dict_bits = LZSS_DICT_BITS;
+			threads[i].options = options;
+			threads[i].encoder = NULL;
+		}
+		// The calling thread takes the first share itself, with this
+		// context, as well as any that a thread couldn't be started for
+		threads[0].encoder = this;
+		for (size_t i = 1; i < thread_count; ++i) {
+			HANDLE handle = CreateThread(NULL, 0, compress_blocks, &threads[i], 0, NULL);
+			if (handle) {
+				handles.push_back(handle);
 			}
 			else {
-				--waiting_bytes;
+				threads[i].encoder = this;
+				compress_blocks(&threads[i]);
 			}
+		}
+		compress_blocks(&threads[0]);
+		if (!handles.empty()) {
+			WaitForMultipleObjects((DWORD)handles.size(), &handles[0], TRUE, INFINITE);
+			for (size_t i = 0; i < handles.size(); ++i) {
+				CloseHandle(handles[i]);
+			}
+		}
 
-			dict_head = (dict_head + 1) & LZSS_DICT_MASK;
-			dict_head_key = generate_key(dict, dict_head, LZSS_DICT_MASK);
+		// Each block continues the bitstream exactly where the one before
+		// it ended
+		for (size_t i = 0; i < blocks.size(); ++i) {
+			device.Append(blocks[i].device);
+			greedy_bits += blocks[i].greedy_bits;
 		}
 	}
 
@@ -257,12 +1495,93 @@ std::vector<uint8_t> compress(uint8_t* fileData, int size, const unsigned int LZ
 		// Write the sentinel offset
 		device.PutBit(false);
 		device.PutBits(0, LZSS_DICT_BITS);
+		greedy_bits += (1 + LZSS_DICT_BITS);
 	}
 
-	delete[] dict;
-	delete[] hash.hash;
-	delete[] hash.prev;
-	delete[] hash.next;
-	
-	return device.buffer;
+	std::vector<uint8_t>& compressed = device.Finish();
+	if (greedySize) {
+		*greedySize = (level == LZSS_LEVEL_OPTIMAL) ? (size_t)((greedy_bits + 7) / 8) : compressed.size();
+	}
+	return compressed;
+}
+
+std::vector<uint8_t> compress(uint8_t* fileData, int size, const unsigned int LZSS_DICT_BITS, const int options,
+	size_t* greedySize)
+{
+	LZSSEncoder encoder;
+	return encoder.Compress(fileData, size, LZSS_DICT_BITS, options, greedySize);
+}
+
+// Times packing at the default level and unpacking, with the coders
+// specialised for 13 and 15 dict bits and with the generic ones, on the
+// files in [inFolderName], or on generated inputs if it is NULL. Both
+// have to produce the same streams.
+int lzssBench(wchar_t inFolderName[])
+{
+	std::vector<std::string> names;
+	std::vector<std::vector<uint8_t> > inputs;
+	if (inFolderName) {
+		if (!benchLoadFolder(inFolderName, names, inputs)) {
+			printf("Given folder not found...\n");
+			return -3;
+		}
+	}
+	else {
+		names.push_back("text");
+		inputs.push_back(benchText(0x40000));
+		names.push_back("bitmap");
+		inputs.push_back(benchBitmap(1024, 768));
+		names.push_back("random");
+		inputs.push_back(benchNoise(0x40000));
+	}
+
+	LZSSEncoder encoder;
+	std::vector<uint8_t> compressed[2];
+	std::vector<uint8_t> decompressed;
+	int failed = 0;
+
+	printf("LZSS speed (MB/s) with generic and specialised dict sizes\n");
+	for (size_t input = 0; input < inputs.size(); ++input) {
+		std::vector<uint8_t>& data = inputs[input];
+		const int size = (int)data.size();
+		decompressed.resize(size);
+		for (unsigned int dictBits = 13; dictBits <= 15; dictBits += 2) {
+			double packSpeed[2];
+			double unpackSpeed[2];
+			for (int variant = 0; variant < 2; ++variant) {
+				specialised_dicts = (variant == 1);
+
+				BenchTimer packTimer;
+				while (packTimer.Running()) {
+					packTimer.Start();
+					compressed[variant] = encoder.Compress(&data[0], size, dictBits, LZSS_LEVEL_DEFAULT);
+					packTimer.Stop();
+				}
+				packSpeed[variant] = packTimer.Rate(size);
+
+				const std::vector<uint8_t>& stream = compressed[variant];
+				bool ok = true;
+				BenchTimer unpackTimer;
+				while (unpackTimer.Running()) {
+					unpackTimer.Start();
+					ok = decompress_into(&stream[0], (int)stream.size(), &decompressed[0], size, dictBits);
+					unpackTimer.Stop();
+				}
+				unpackSpeed[variant] = unpackTimer.Rate(size);
+				if (!ok || (decompressed != data)) {
+					printf("%s doesn't round-trip at %u bits!\n", names[input].c_str(), dictBits);
+					++failed;
+				}
+			}
+			specialised_dicts = true;
+			if (compressed[0] != compressed[1]) {
+				printf("%s packs differently at %u bits!\n", names[input].c_str(), dictBits);
+				++failed;
+			}
+
+			printf("%-12s %2u-bit   pack %7.1f -> %7.1f   unpack %7.1f -> %7.1f\n", names[input].c_str(), dictBits,
+				packSpeed[0], packSpeed[1], unpackSpeed[0], unpackSpeed[1]);
+		}
+	}
+	return (failed == 0) ? 0 : -10;
 }
\ No newline at end of file
@@ -1,4 +1,4 @@
 #pragma once
 
 int pbg1AExtract(wchar_t inDatName[], wchar_t outFolderName[], std::wstring renameType);
-int pbg1APack(wchar_t inFolderName[], wchar_t outDatName[]);
\ No newline at end of file
+int pbg1APack(wchar_t inFolderName[], wchar_t outDatName[], int level);
\ No newline at end of file
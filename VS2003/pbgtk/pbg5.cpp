@@ -54,8 +54,21 @@ int pbg5Extract(wchar_t inDatName[], wchar_t outFolderName[])
 	// packfile size and TOC offset
 	struct _stat s;
 	_wstat(inDatName, &s);
+	if ((curr5Header.tocOffset < sizeof(PBG5Header)) || (curr5Header.tocOffset > (uint32_t)s.st_size)) {
+		printf("Not a valid packfile!\n");
+		return -2;
+	}
 	size_t compressedTOCSize = s.st_size - curr5Header.tocOffset;
 
+	// Every entry takes at least a null terminator and 3 numbers, and LZSS
+	// can't expand data by more than 8 times (18 bytes from 20 bits), so
+	// anything beyond that would only allocate memory for garbage
+	if ((curr5Header.numOfFiles > (curr5Header.decompressedTOCSize / 13)) ||
+		((curr5Header.decompressedTOCSize / 8) > compressedTOCSize)) {
+		printf("Corrupt table of contents!\n");
+		return -10;
+	}
+
 	// Read in and decompress table of contents
 	uint8_t* compressedTOC = new uint8_t[compressedTOCSize];
 	fseek(inDat, curr5Header.tocOffset, SEEK_SET);
@@ -63,6 +76,10 @@ int pbg5Extract(wchar_t inDatName[], wchar_t outFolderName[])
 	uint8_t* decompressedTOC = decompress(compressedTOC, curr5Header.decompressedTOCSize,
 		compressedTOCSize, 15);
 	delete[] compressedTOC;
+	if (!decompressedTOC) {
+		printf("Corrupt table of contents!\n");
+		return -10;
+	}
 
 	// Table of contents reading loop
 	PBG5FileInfo* curr5FileInfos = new PBG5FileInfo[curr5Header.numOfFiles];
@@ -70,6 +87,14 @@ int pbg5Extract(wchar_t inDatName[], wchar_t outFolderName[])
 	for (uint32_t fileIndex = 0; fileIndex < curr5Header.numOfFiles; ++fileIndex)
 	{
 		PBG5FileInfo curr5FileInfo = { 0 };
+		// The table of contents has no CRC, so make sure the entry fits
+		const uint8_t* filenameEnd = (const uint8_t*)memchr(decompressedTOC + pos, 0,
+			curr5Header.decompressedTOCSize - pos);
+		if (!filenameEnd || ((uint32_t)(filenameEnd - decompressedTOC) + 13 > curr5Header.decompressedTOCSize)) {
+			delete[] decompressedTOC;
+			printf("Corrupt table of contents!\n");
+			return -10;
+		}
 		std::string filename = (char*)(decompressedTOC + pos);
 		int filenameLen = filename.length() + 1;
 		curr5FileInfo.filename = new char[filenameLen];
@@ -85,7 +110,25 @@ int pbg5Extract(wchar_t inDatName[], wchar_t outFolderName[])
 	}
 	delete[] decompressedTOC;
 
+	// Each entry runs up to the next one, and the last one up to the table
+	// of contents, which has to stay within the packfile
+	uint32_t badEntries = 0;
+	for (uint32_t fileIndex = 0; fileIndex < curr5Header.numOfFiles; ++fileIndex) {
+		const uint32_t end = (fileIndex + 1 != curr5Header.numOfFiles) ?
+			curr5FileInfos[fileIndex + 1].offset : curr5Header.tocOffset;
+		if ((curr5FileInfos[fileIndex].offset < sizeof(PBG5Header)) || (curr5FileInfos[fileIndex].offset > end)) {
+			printf("%s lies outside the packfile!\n", curr5FileInfos[fileIndex].filename);
+			++badEntries;
+		}
+	}
+	if (badEntries != 0) {
+		printf("Packfile is truncated or corrupt!\n");
+		return -10;
+	}
+
 	// File extraction loop
+	LZSSDecoder decoder;
+	uint32_t failedFiles = 0;
 	for (uint32_t fileIndex = 0; fileIndex < curr5Header.numOfFiles; ++fileIndex) {
 		int byteCount = MultiByteToWideChar(932, 0, curr5FileInfos[fileIndex].filename, -1, NULL, 0);
 		wchar_t* wideFilename = new wchar_t[byteCount];
@@ -108,10 +151,8 @@ int pbg5Extract(wchar_t inDatName[], wchar_t outFolderName[])
 				curr5FileInfos[fileIndex].offset;
 		}
 
-		// Read in compressed fle data
-		uint8_t* currFileData = new uint8_t[compressedSize];
+		// Seek to compressed file data
 		fseek(inDat, curr5FileInfos[fileIndex].offset, SEEK_SET);
-		fread(currFileData, compressedSize, 1, inDat);
 
 		//Set output path and write decompressed file
 		wchar_t outPath[MAX_PATH];
@@ -122,21 +163,33 @@ int pbg5Extract(wchar_t inDatName[], wchar_t outFolderName[])
 			printf("Failed to open output file!\n");
 			return -8;
 		}
-		uint8_t* decompressedFileData = decompress(currFileData, 
-			curr5FileInfos[fileIndex].uncompressedSize, compressedSize, 15);
-		delete[] currFileData;
-		fwrite(decompressedFileData, curr5FileInfos[fileIndex].uncompressedSize, 1, outFile);
-		delete[] decompressedFileData;
+		uint32_t crc = 0;
+		if (!decoder.Extract(inDat, compressedSize, outFile,
+			curr5FileInfos[fileIndex].uncompressedSize, 15, &crc)) {
+			fclose(outFile);
+			printf("Corrupt file data!\n");
+			return -10;
+		}
 		fclose(outFile);
+
+		// Check the data against the CRC in the table of contents
+		if (crc != curr5FileInfos[fileIndex].decompressedCRCSum) {
+			printf("%s failed the CRC check!\n", curr5FileInfos[fileIndex].filename);
+			++failedFiles;
+		}
 	}
 	
 	fclose(inDat);
+	if (failedFiles != 0) {
+		printf("%u files failed the CRC check!\n", failedFiles);
+		return -11;
+	}
 	printf("Files successfully extracted!\n");
 	return 0;
 }
 
 // Pack a PBG5 packfile
-int pbg5Pack(wchar_t inFolderName[], wchar_t outDatName[])
+int pbg5Pack(wchar_t inFolderName[], wchar_t outDatName[], int level)
 {
 	WIN32_FIND_DATAW ffd;
 	HANDLE hFind = INVALID_HANDLE_VALUE;
@@ -175,6 +228,8 @@ int pbg5Pack(wchar_t inFolderName[], wchar_t outDatName[])
 	hFind = FindFirstFileW(searchPath, &ffd);
 
 	uint32_t fileIndex = 0;
+	LZSSEncoder encoder;
+	long savedBytes = 0;
 	struct _stat s;
 	// File packing loop
 	do {
@@ -209,14 +264,14 @@ int pbg5Pack(wchar_t inFolderName[], wchar_t outDatName[])
 			// Compress and write file to packfile
 			uint8_t* currFileData = new uint8_t[curr5FileInfo.uncompressedSize];
 			fread(currFileData, curr5FileInfo.uncompressedSize, 1, inFile);
-			std::vector<uint8_t> compressedData = compress(currFileData, 
-				curr5FileInfo.uncompressedSize, 15);
+			size_t greedySize = 0;
+			std::vector<uint8_t> compressedData = encoder.Compress(currFileData, 
+				curr5FileInfo.uncompressedSize, 15, level, &greedySize);
+			savedBytes += (long)(greedySize - compressedData.size());
 			fwrite(&compressedData[0], compressedData.size(), 1, outDat);
 
 			// Calculate CRC32 of uncompressed file
-			uint32_t table[256];
-			crc32::generate_table(table);
-			curr5FileInfo.decompressedCRCSum = crc32::update(table, 0, currFileData, 
+			curr5FileInfo.decompressedCRCSum = crc32::update(0, currFileData, 
 				curr5FileInfo.uncompressedSize);
 			delete[] currFileData;
 
@@ -250,7 +305,10 @@ int pbg5Pack(wchar_t inFolderName[], wchar_t outDatName[])
 	}
 
 	// Compress and write table of contents buffer to packfile
-	std::vector<uint8_t> compressedTOC = compress(toCompress, curr5Header.decompressedTOCSize, 15);
+	size_t greedySize = 0;
+	std::vector<uint8_t> compressedTOC = encoder.Compress(toCompress, curr5Header.decompressedTOCSize, 15, level,
+		&greedySize);
+	savedBytes += (long)(greedySize - compressedTOC.size());
 	fwrite(&compressedTOC[0], compressedTOC.size(), 1, outDat);
 	delete[] toCompress;
 
@@ -260,6 +318,9 @@ int pbg5Pack(wchar_t inFolderName[], wchar_t outDatName[])
 	fwrite(&curr5Header, sizeof(PBG5Header), 1, outDat);
 	fclose(outDat);
 
+	if ((level & LZSS_LEVEL_MASK) == LZSS_LEVEL_OPTIMAL) {
+		printf("Optimal parsing saved %ld bytes over longest-match greedy parsing\n", savedBytes);
+	}
 	printf("Files successfully packed!\n");
 	return 0;
 }
\ No newline at end of file
@@ -1,4 +1,5 @@
 #pragma once
 
 int pbg6Extract(wchar_t inDatName[], wchar_t outFolderName[]);
-int pbg6Pack(wchar_t inFolderName[], wchar_t outDatName[]);
\ No newline at end of file
+int pbg6Pack(wchar_t inFolderName[], wchar_t outDatName[]);
+int pbg6Bench();
\ No newline at end of file
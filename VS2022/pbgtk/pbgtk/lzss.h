@@ -2,22 +2,81 @@
 
 #pragma once
 
+#include <cstdio>
 #include <vector>
 #include "stdint.h"
 
+// Entries larger than this are extracted through LZSSStream, reading
+// LZSS_STREAM_CHUNK bytes of input and writing LZSS_STREAM_BLOCK bytes of
+// output at a time
+const size_t LZSS_STREAM_THRESHOLD = 0x20000;
+const size_t LZSS_STREAM_CHUNK = 0x10000;
+const uint32_t LZSS_STREAM_BLOCK = 0x20000;
+
+// Block size in which decompress_into() checksums its output
+const uint32_t LZSS_CRC_BLOCK = 0x4000;
+
+// Compression levels for compress(), trading packing speed for size. All
+// of them produce standard streams that the games can read.
+enum LZSSLevel {
+	LZSS_LEVEL_FAST,	// Greedy matching over a short hash chain
+	LZSS_LEVEL_DEFAULT,	// One-step lazy matching over a longer chain
+	LZSS_LEVEL_MAX,		// One-step lazy matching over the whole chain
+	LZSS_LEVEL_OPTIMAL	// Cheapest possible tokens for the longest matches
+};
+const int LZSS_LEVEL_MASK = 0xFF;
+
+// Match finders for compress(), selected by ORing one into the level
+enum LZSSMatchFinder {
+	LZSS_FINDER_CHAIN = 0x000,	// Hash chains over the dict ring
+	LZSS_FINDER_TREE = 0x100	// Binary trees, for long repetitive inputs
+};
+
+// Block-parallel encoding for compress(), selected by ORing a block size in
+// KiB, shifted left by LZSS_BLOCK_SHIFT, into the level. Inputs larger than
+// one block are split into blocks that are encoded on separate threads, each
+// with the dict primed from the input in front of it, and joined into one
+// stream. The output only depends on the block size, not on the number of
+// threads. 0 encodes the whole input in one go.
+const int LZSS_BLOCK_SHIFT = 16;
+
+// Hash chains of the LZSS encoder. Dict offsets always fit into 16 bits, so
+// every [head] entry holds the newest offset for its key in its low half and
+// the epoch it was added in in its high half. An entry only counts if that
+// is the current [epoch], so starting a new epoch empties all chains at once.
+// [links] holds the previous and next offset of each dict slot next to each
+// other, so following a chain touches one cache line per step. They are only
+// ever read for offsets that have been added in the current epoch, and need
+// no clearing at all.
 struct hash_t {
-	unsigned int* hash;
-	unsigned int* prev;
-	unsigned int* next;
+	uint32_t* head;
+	uint16_t* links;
+	uint16_t epoch;
 
 	hash_t(const unsigned int DICT_SIZE) {
-		hash = new unsigned int[0x10000];
-		prev = new unsigned int[DICT_SIZE];
-		next = new unsigned int[DICT_SIZE];
-		memset(hash, 0, 0x10000 * sizeof(unsigned int));
-		memset(prev, 0, DICT_SIZE * sizeof(unsigned int));
-		memset(next, 0, DICT_SIZE * sizeof(unsigned int));
+		head = new uint32_t[0x10000];
+		links = new uint16_t[DICT_SIZE * 2];
+		memset(head, 0, 0x10000 * sizeof(uint32_t));
+		epoch = 0;
+	}
+
+	~hash_t() {
+		delete[] head;
+		delete[] links;
 	}
+
+	// Empties all chains
+	void NextEpoch() {
+		if (++epoch == 0) {
+			memset(head, 0, 0x10000 * sizeof(uint32_t));
+			epoch = 1;
+		}
+	}
+
+private:
+	// Not copyable, as it owns its tables
+	hash_t(const hash_t&);
+	hash_t& operator =(const hash_t&);
 };
 
 class BitReader {
@@ -51,17 +110,284 @@ public:
 	uint32_t GetBits(size_t bitcount);
 };
 
-struct BitWriter {
+// Bit reader for the LZSS decoder's hot loop. Keeps up to 64 bits of the
+// stream buffered, MSB first, and refills it a word at a time, so a whole
+// token can be peeked with one shift and consumed with another. Reads past
+// the end of the stream return zero bits.
+class BitReader64 {
+	const uint8_t* buffer;
+	size_t size;
+	size_t pos;
+	uint64_t window;
+	unsigned int count;
+
+	static inline uint64_t LoadBE64(const uint8_t* p)
+	{
+		return ((uint64_t)p[0] << 56) | ((uint64_t)p[1] << 48) |
+			((uint64_t)p[2] << 40) | ((uint64_t)p[3] << 32) |
+			((uint64_t)p[4] << 24) | ((uint64_t)p[5] << 16) |
+			((uint64_t)p[6] << 8) | ((uint64_t)p[7] << 0);
+	}
+
+public:
+	BitReader64(const uint8_t* mem, size_t givenSize) {
+		buffer = mem;
+		size = givenSize;
+		pos = 0;
+		window = 0;
+		count = 0;
+	}
+
+	// True if the next refill can load a whole word of real input
+	inline bool CanRefillFast() const
+	{
+		return ((pos + 8) <= size);
+	}
+
+	// Tops the window up to at least 57 valid bits from a whole word of
+	// input. Only valid if CanRefillFast().
+	inline void RefillFast()
+	{
+		window |= (LoadBE64(buffer + pos) >> count);
+		pos += ((63 - count) >> 3);
+		count |= 56;
+	}
+
+	// Tops the window up to at least 57 valid bits, which always covers
+	// one literal (9 bits) or match (up to 20 bits) token.
+	inline void Refill()
+	{
+		if (count > 56) {
+			return;
+		}
+		if (CanRefillFast()) {
+			RefillFast();
+		}
+		else {
+			while (count <= 56) {
+				const uint64_t byte = (pos < size) ? buffer[pos] : 0;
+				window |= (byte << (56 - count));
+				count += 8;
+				++pos;
+			}
+		}
+	}
+
+	// Returns the next [bitcount] (1 to 32) bits without consuming them.
+	inline uint32_t Peek(unsigned int bitcount) const
+	{
+		return (uint32_t)(window >> (64 - bitcount));
+	}
+
+	// Returns the whole window, with the next bit in the top position.
+	// Only the top [count] bits are valid. After RefillFast(), the bits
+	// past them hold input that will be loaded again by the next refill,
+	// and past the end of the input they are zero.
+	inline uint64_t PeekWindow() const
+	{
+		return window;
+	}
+
+	inline void Skip(unsigned int bitcount)
+	{
+		window <<= bitcount;
+		count -= bitcount;
+	}
+
+	// Number of bits consumed so far, including any zero bits read past
+	// the end of the stream
+	inline size_t BitsConsumed() const
+	{
+		return ((pos * 8) - count);
+	}
+
+	inline size_t BitsInStream() const
+	{
+		return (size * 8);
+	}
+};
+
+// Bit writer for the LZSS and PBG3 TOC encoders. Collects bits MSB first in
+// a 64-bit accumulator and stores them to [buffer] 32 bits at a time.
+// [buffer] grows on demand, but should be reserved up front from a size
+// bound if one is known. Call Finish() to flush the last partial byte and
+// trim [buffer] to the bytes actually written.
+class BitWriter {
 	std::vector<uint8_t> buffer;
-	uint8_t bit_cursor:3;
+	size_t pos;
+	uint64_t window;
+	unsigned int count;
 
+	void FlushWord();
+
+public:
 	BitWriter() {
-		bit_cursor = 0;
+		pos = 0;
+		window = 0;
+		count = 0;
+	}
+
+	// Makes sure at least [bytes] bytes of output fit without regrowing
+	void Reserve(size_t bytes)
+	{
+		if (buffer.size() < bytes) {
+			buffer.resize(bytes);
+		}
 	}
 
-	void PutBit(uint8_t bit);
-	void PutBits(uint32_t bits, unsigned int bitcount);
+	inline void PutBit(uint8_t bit)
+	{
+		PutBits(bit, 1);
+	}
+
+	// Writes the low [bitcount] (1 to 32) bits of [bits]
+	inline void PutBits(uint32_t bits, unsigned int bitcount)
+	{
+		bits &= (0xFFFFFFFF >> (32 - bitcount));
+		window |= ((uint64_t)bits << (64 - count - bitcount));
+		count += bitcount;
+		if (count >= 32) {
+			FlushWord();
+		}
+	}
+
+	// Writes all bits written to [other] so far, which doesn't have to end
+	// on a byte boundary
+	void Append(const BitWriter& other);
+
+	// Pads the stream to a whole byte and returns it
+	std::vector<uint8_t>& Finish();
+};
+
+// Incremental LZSS decoder, for entries too large to comfortably hold in
+// memory. Its state is the bit cursor into the buffered input, the dict ring
+// (kept as at least DICT_SIZE bytes of history in front of the output block)
+// and the output position. Input is fed in chunks of up to LZSS_STREAM_CHUNK
+// bytes, and output comes out in blocks of about LZSS_STREAM_BLOCK bytes.
+class LZSSStream {
+	uint8_t* input;
+	size_t input_size;
+	size_t input_bit;
+	bool input_last;
+	uint8_t* window;
+	uint32_t out_i;
+	uint32_t remaining;
+	unsigned int dict_bits;
+	bool corrupt;
+
+	// Not copyable, as it owns its buffers
+	LZSSStream(const LZSSStream&);
+	LZSSStream& operator =(const LZSSStream&);
+
+public:
+	LZSSStream();
+	~LZSSStream();
+
+	// Starts decoding a new entry of [uncompSize] bytes
+	void Begin(uint32_t uncompSize, const unsigned int dictBits);
+
+	// Appends the next chunk of compressed input. Only valid once Decode()
+	// has run out of input. [last] marks the final chunk of the entry.
+	void Feed(const uint8_t* data, size_t size, bool last);
+
+	// Decodes the next block, returning it and storing its size in [size].
+	// The block stays valid until the next call. A size of 0 means that
+	// more input is needed, or that the entry is finished.
+	const uint8_t* Decode(size_t& size);
+
+	bool Finished() const {
+		return (corrupt || (remaining == 0));
+	}
+
+	// True if the entry turned out to be truncated or otherwise invalid
+	bool Corrupt() const {
+		return corrupt;
+	}
+};
+
+// Reusable decoding context. Holds scratch buffers for an entry's compressed
+// and decompressed data, grown to the largest entry seen so far, so that
+// extracting a packfile doesn't allocate twice per entry.
+class LZSSDecoder {
+	uint8_t* input;
+	size_t inputCapacity;
+	uint8_t* output;
+	size_t outputCapacity;
+	LZSSStream stream;
+
+	// Not copyable, as it owns its buffers
+	LZSSDecoder(const LZSSDecoder&);
+	LZSSDecoder& operator =(const LZSSDecoder&);
+
+public:
+	LZSSDecoder() {
+		input = NULL;
+		inputCapacity = 0;
+		output = NULL;
+		outputCapacity = 0;
+	}
+
+	~LZSSDecoder() {
+		delete[] input;
+		delete[] output;
+	}
+
+	// Returns a buffer of at least [size] bytes. Previous contents are
+	// not preserved if it has to grow.
+	uint8_t* InputBuffer(size_t size);
+	uint8_t* OutputBuffer(size_t size);
+
+	// Decodes an entry of [compSize] bytes, read from the current position
+	// of [in], and writes it to [out]. Entries above LZSS_STREAM_THRESHOLD
+	// bytes go through the streaming decoder, so memory use stays bounded
+	// no matter how large the entry is. Returns false if the entry is
+	// corrupt, in which case [out] may have been partially written.
+	// If [crc] is given, it receives the CRC32 of the decoded data.
+	bool Extract(FILE* in, size_t compSize, FILE* out, uint32_t uncompSize, const unsigned int dictBits,
+		uint32_t* crc = NULL);
+};
+
+// Reusable encoding context. Keeps the dict ring and match finder tables of
+// compress() across calls, so that packing many small files doesn't
+// allocate and clear them for every file. The tables are reset by starting
+// a new epoch rather than by clearing them.
+class LZSSEncoder {
+	unsigned int dictBits;
+	uint8_t* dict;
+	hash_t* hash;
+	uint32_t* treeHead;
+	uint32_t* treeStamp;
+	uint32_t* treeSon;
+	uint32_t treeEpoch;
+
+	// Not copyable, as it owns its buffers
+	LZSSEncoder(const LZSSEncoder&);
+	LZSSEncoder& operator =(const LZSSEncoder&);
+
+	// Makes sure the tables fit a dict of [bits] bits and the finder in
+	// [options], and empties them
+	void Prepare(const unsigned int bits, const int options);
+
+public:
+	LZSSEncoder();
+	~LZSSEncoder();
+
+	// Same as compress()
+	std::vector<uint8_t> Compress(uint8_t* fileData, int size, const unsigned int dictBits, const int options,
+		size_t* greedySize = NULL);
+
+	// Encodes bytes [begin] to [end] of [fileData] into [device], as the
+	// part of a stream that follows the tokens for the bytes before
+	// [begin]. Returns the number of bits greedy parsing, taking the longest
+	// match at every position, would have written for LZSS_LEVEL_OPTIMAL,
+	// or 0 for any other level.
+	uint64_t CompressRange(const uint8_t* fileData, size_t begin, size_t end, const unsigned int dictBits,
+		const int options, BitWriter& device);
 };
 
+bool decompress_into(const uint8_t* fileData, int compSize, uint8_t* uncompressed, int uncompSize, const unsigned int LZSS_DICT_BITS,
+	uint32_t* crc = NULL);
 uint8_t* decompress(uint8_t* fileData, int uncompSize, int compSize, const unsigned int LZSS_DICT_BITS);
-std::vector<uint8_t> compress(uint8_t* fileData, int size, const unsigned int DICT_BITS);
\ No newline at end of file
+std::vector<uint8_t> compress(uint8_t* fileData, int size, const unsigned int DICT_BITS, const int options,
+	size_t* greedySize = NULL);
+int lzssBench(wchar_t inFolderName[]);
\ No newline at end of file
@@ -12,12 +12,15 @@
 #include "pbg4.h"
 #include "pbg5.h"
 #include "pbg6.h"
+#include "lzss.h"
+#include "bench.h"
 
 // Print program usage
 void printUsage(wchar_t exeName[])
 {
 	printf("Usage: %ls extract version in_dat out_folder (--rename (preset))\n", exeName);
-	printf("OR     %ls pack version in_folder out_dat (--remove-extensions)\n", exeName);
+	printf("OR     %ls pack version in_folder out_dat (--remove-extensions) (--level (level)) (--finder (finder)) (--block-size (KiB))\n", exeName);
+	printf("OR     %ls bench suite (in_folder)\n", exeName);
 }
 
 // Print auto-rename option usage
@@ -28,12 +31,39 @@ void printRenameUsage()
 	printf("For Seihou 2 (PBG3): enemy, graph, graph2, graph3, music, or sound\n");
 }
 
+// Print compression level option usage
+void printLevelUsage()
+{
+	printf("Improper compression level specified!\n");
+	printf("For PBG1A, PBG3, PBG4, and PBG5: fast, default, max, or optimal\n");
+}
+
+// Print match finder option usage
+void printFinderUsage()
+{
+	printf("Improper match finder specified!\n");
+	printf("For PBG1A, PBG3, PBG4, and PBG5: chain or tree\n");
+}
+
+// Print block size option usage
+void printBlockSizeUsage()
+{
+	printf("Improper block size specified!\n");
+	printf("For PBG1A, PBG3, PBG4, and PBG5: a size in KiB from 1 to 65535\n");
+}
+
 // Main program
 int wmain(int argc, wchar_t* argv[])
 {
 	// Force console output to Shift-JIS
 	SetConsoleOutputCP(932);
 
+	// Benchmarks only need the name of their suite, and some can take a
+	// folder of files to run on
+	if ((argc >= 3) && (std::wstring(argv[1]) == L"bench")) {
+		return bench(argv[2], (argc >= 4) ? argv[3] : NULL);
+	}
+
 	// Make sure there are enough arguments to run the utility
 	if (argc < 5) {
 		printUsage(argv[0]);
@@ -115,22 +145,103 @@ int wmain(int argc, wchar_t* argv[])
 	}
 	else if (option == L"pack")
 	{
+		// Collect extra packing options, which may come in any order
+		bool removeExtensions = false;
+		int level = LZSS_LEVEL_DEFAULT;
+		int finder = LZSS_FINDER_CHAIN;
+		unsigned long blockSize = 0;
+		bool lzssOptions = false;
+		for (int argIndex = 5; argIndex < argc; ++argIndex) {
+			std::wstring extraArg = argv[argIndex];
+			if (extraArg == L"--remove-extensions") {
+				removeExtensions = true;
+			}
+			else if (extraArg == L"--level") {
+				lzssOptions = true;
+				// Make sure a compression level is provided
+				if (argIndex + 1 >= argc) {
+					printLevelUsage();
+					return -7;
+				}
+				// Store compression level as lowercase string
+				std::wstring lowercaseLevel = argv[++argIndex];
+				for (uint32_t charIndex = 0; charIndex < lowercaseLevel.length(); ++charIndex) {
+					lowercaseLevel[charIndex] = tolower(lowercaseLevel[charIndex]);
+				}
+				if (lowercaseLevel == L"fast") {
+					level = LZSS_LEVEL_FAST;
+				}
+				else if (lowercaseLevel == L"default") {
+					level = LZSS_LEVEL_DEFAULT;
+				}
+				else if (lowercaseLevel == L"max") {
+					level = LZSS_LEVEL_MAX;
+				}
+				else if (lowercaseLevel == L"optimal") {
+					level = LZSS_LEVEL_OPTIMAL;
+				}
+				else {
+					printLevelUsage();
+					return -6;
+				}
+			}
+			else if (extraArg == L"--finder") {
+				lzssOptions = true;
+				// Make sure a match finder is provided
+				if (argIndex + 1 >= argc) {
+					printFinderUsage();
+					return -7;
+				}
+				// Store match finder as lowercase string
+				std::wstring lowercaseFinder = argv[++argIndex];
+				for (uint32_t charIndex = 0; charIndex < lowercaseFinder.length(); ++charIndex) {
+					lowercaseFinder[charIndex] = tolower(lowercaseFinder[charIndex]);
+				}
+				if (lowercaseFinder == L"chain") {
+					finder = LZSS_FINDER_CHAIN;
+				}
+				else if (lowercaseFinder == L"tree") {
+					finder = LZSS_FINDER_TREE;
+				}
+				else {
+					printFinderUsage();
+					return -6;
+				}
+			}
+			else if (extraArg == L"--block-size") {
+				lzssOptions = true;
+				// Make sure a block size is provided
+				if (argIndex + 1 >= argc) {
+					printBlockSizeUsage();
+					return -7;
+				}
+				wchar_t* sizeEnd = NULL;
+				blockSize = wcstoul(argv[++argIndex], &sizeEnd, 10);
+				if (*sizeEnd != L'\0' || blockSize < 1 || blockSize > 0xFFFF) {
+					printBlockSizeUsage();
+					return -6;
+				}
+			}
+		}
+		// The match finder and block size travel along with the level
+		level |= finder;
+		level |= (int)(blockSize << LZSS_BLOCK_SHIFT);
+
 		switch (version.at(0)) {
 			case '1':
-				return pbg1APack(argv[3], argv[4]);
+				return pbg1APack(argv[3], argv[4], level);
 			case '3':
-				if (argc >= 6) {
-					std::wstring extraArg = argv[5];
-					if (extraArg == L"--remove-extensions") {
-						return pbg3Pack(argv[3], argv[4], true);
-					}
-				}
-				return pbg3Pack(argv[3], argv[4], false);
+				return pbg3Pack(argv[3], argv[4], removeExtensions, level);
 			case '4':
-				return pbg4Pack(argv[3], argv[4]);
+				return pbg4Pack(argv[3], argv[4], level);
 			case '5':
-				return pbg5Pack(argv[3], argv[4]);
+				return pbg5Pack(argv[3], argv[4], level);
 			case '6':
+				// PBG6 has its own compression, which these can't tune
+				if (lzssOptions) {
+					printf("--level, --finder, and --block-size only apply to PBG1A, PBG3, PBG4, and PBG5!\n");
+					return -6;
+				}
 				return pbg6Pack(argv[3], argv[4]);
 			default:
 				printUsage(argv[0]);
@@ -57,6 +57,7 @@ int pbg1AExtract(wchar_t inDatName[], wchar_t outFolderName[], std::wstring rena
 
 	// File extraction loop
 	struct _stat s;
+	LZSSDecoder decoder;
 	for (uint32_t fileIndex = 0; fileIndex < curr1AHeader.numOfFiles; ++fileIndex) {
 		// Calculate compressed file size from the difference between the next file's offset
 		// and this file's offset... or the difference between this file's offset and the 
@@ -72,10 +73,6 @@ int pbg1AExtract(wchar_t inDatName[], wchar_t outFolderName[], std::wstring rena
 				curr1AFileInfos[fileIndex].offset;
 		}
 
-		// Read in file data
-		uint8_t* currFileData = new uint8_t[compressedSize];
-		fread(currFileData, compressedSize, 1, inDat);
-
 		// Set output path and write decompressed file
 		wchar_t outPath[MAX_PATH];
 		uint32_t pos = swprintf(outPath, L"%ls\\%02i", outFolderName, fileIndex);
@@ -183,11 +180,14 @@ int pbg1AExtract(wchar_t inDatName[], wchar_t outFolderName[], std::wstring rena
 			printf("Unable to open output file!\n");
 			return -8;
 		}
-		uint8_t* decompressedFile = decompress(currFileData, 
-			curr1AFileInfos[fileIndex].uncompressedSize, compressedSize, 13);
-		delete[] currFileData;
-		fwrite(decompressedFile, curr1AFileInfos[fileIndex].uncompressedSize, 1, outFile);
-		delete[] decompressedFile;
+		// Seek to compressed file data
+		fseek(inDat, curr1AFileInfos[fileIndex].offset, SEEK_SET);
+		if (!decoder.Extract(inDat, compressedSize, outFile,
+			curr1AFileInfos[fileIndex].uncompressedSize, 13)) {
+			fclose(outFile);
+			printf("Corrupt file data!\n");
+			return -10;
+		}
 		fclose(outFile);
 	}
 
@@ -197,7 +197,7 @@ int pbg1AExtract(wchar_t inDatName[], wchar_t outFolderName[], std::wstring rena
 }
 
 // Pack a PBG1A packfile
-int pbg1APack(wchar_t inFolderName[], wchar_t outDatName[])
+int pbg1APack(wchar_t inFolderName[], wchar_t outDatName[], int level)
 {
 	WIN32_FIND_DATAW ffd;
 	HANDLE hFind = INVALID_HANDLE_VALUE;
@@ -237,6 +237,8 @@ int pbg1APack(wchar_t inFolderName[], wchar_t outDatName[])
 	hFind = FindFirstFileW(searchPath, &ffd);
 
 	uint32_t fileIndex = 0;
+	LZSSEncoder encoder;
+	long savedBytes = 0;
 	struct _stat s;
 	// File packing loop
 	do {
@@ -273,8 +275,10 @@ int pbg1APack(wchar_t inFolderName[], wchar_t outDatName[])
 			fread(currFileData, curr1AFileInfo.uncompressedSize, 1, inFile);
 
 			// Compress and write file data (13 dict bits)
-			std::vector<uint8_t> compressedData = compress(currFileData, 
-				curr1AFileInfo.uncompressedSize, 13);
+			size_t greedySize = 0;
+			std::vector<uint8_t> compressedData = encoder.Compress(currFileData, 
+				curr1AFileInfo.uncompressedSize, 13, level, &greedySize);
+			savedBytes += (long)(greedySize - compressedData.size());
 			fwrite(&compressedData[0], compressedData.size(), 1, outDat);
 			delete[] currFileData;
 
@@ -300,6 +304,9 @@ int pbg1APack(wchar_t inFolderName[], wchar_t outDatName[])
 	fwrite(curr1AFileInfos, sizeof(PBG1AFileInfo), curr1AHeader.numOfFiles, outDat);
 	fclose(outDat);
 
+	if ((level & LZSS_LEVEL_MASK) == LZSS_LEVEL_OPTIMAL) {
+		printf("Optimal parsing saved %ld bytes over longest-match greedy parsing\n", savedBytes);
+	}
 	printf("Files successfully packed!\n");
 	return 0;
 }
\ No newline at end of file
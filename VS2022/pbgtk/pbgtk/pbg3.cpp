@@ -80,13 +80,14 @@ class PBG3BitWriter {
 
 		std::vector<uint8_t> getBuffer()
 		{
-			return writer.buffer;
+			return writer.Finish();
 		}
 };
 
 // Recursive file packing
 int searchAndPack(const wchar_t* folderName, FILE* outDat, std::vector<PBG3FileInfo> &curr3FileInfos,
-				  bool removeExtensions, const wchar_t* baseFolderName)
+				  bool removeExtensions, const wchar_t* baseFolderName, int level, LZSSEncoder& encoder,
+				  long& savedBytes)
 {
 	WIN32_FIND_DATAW ffd;
 	HANDLE hFind = INVALID_HANDLE_VALUE;
@@ -113,7 +114,7 @@ int searchAndPack(const wchar_t* folderName, FILE* outDat, std::vector<PBG3FileI
 			// Recursively call to pack if this is a directory
 			if (ffd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
 				int searchPackResult = searchAndPack(path, outDat, curr3FileInfos,
-													 removeExtensions, baseFolderName);
+													 removeExtensions, baseFolderName, level, encoder, savedBytes);
 				if (searchPackResult != 0) {
 					return searchPackResult;
 				}
@@ -166,7 +167,10 @@ int searchAndPack(const wchar_t* folderName, FILE* outDat, std::vector<PBG3FileI
 				fread(currFileData, curr3FileInfo.uncompressedSize, 1, inFile);
 
 				// Compress and write file data
-				std::vector<uint8_t> compressedData = compress(currFileData, curr3FileInfo.uncompressedSize, 13);
+				size_t greedySize = 0;
+				std::vector<uint8_t> compressedData = encoder.Compress(currFileData, curr3FileInfo.uncompressedSize, 13, level,
+					&greedySize);
+				savedBytes += (long)(greedySize - compressedData.size());
 				fwrite(&compressedData[0], compressedData.size(), 1, outDat);
 				delete[] currFileData;
 
@@ -240,6 +244,7 @@ int pbg3Extract(wchar_t inDatName[], wchar_t outFolderName[], std::wstring renam
 	}
 
 	// File extraction loop
+	LZSSDecoder decoder;
 	for (uint32_t fileIndex = 0; fileIndex < curr3Header.numOfFiles; ++fileIndex) {
 		std::string filename = curr3FileInfos[fileIndex].filename;
 		delete[] curr3FileInfos[fileIndex].filename;
@@ -282,11 +287,6 @@ int pbg3Extract(wchar_t inDatName[], wchar_t outFolderName[], std::wstring renam
 				curr3FileInfos[fileIndex].offset;
 		}
 
-		// Read compressed file data
-		fseek(inDat, curr3FileInfos[fileIndex].offset, SEEK_SET);
-		uint8_t* currFileData = new uint8_t[compressedSize];
-		fread(currFileData, compressedSize, 1, inDat);
-
 		int byteCount = MultiByteToWideChar(932, 0, filename.c_str(), -1, NULL, 0);
 		wchar_t* wideFilename = new wchar_t[byteCount];
 		// Store filename as wide char with proper Shift-JIS encoding
@@ -345,10 +345,13 @@ int pbg3Extract(wchar_t inDatName[], wchar_t outFolderName[], std::wstring renam
 			printf("Unable to open output file!\n");
 			return -8;
 		}
-		uint8_t* decompressedFileData = decompress(currFileData, curr3FileInfos[fileIndex].uncompressedSize,
-			compressedSize, 13);
-		fwrite(decompressedFileData, curr3FileInfos[fileIndex].uncompressedSize, 1, outFile);
-		delete[] decompressedFileData;
+		fseek(inDat, curr3FileInfos[fileIndex].offset, SEEK_SET);
+		if (!decoder.Extract(inDat, compressedSize, outFile,
+			curr3FileInfos[fileIndex].uncompressedSize, 13)) {
+			fclose(outFile);
+			printf("Corrupt file data!\n");
+			return -10;
+		}
 		fclose(outFile);
 		delete[] wideFilename;
 	}
@@ -359,7 +362,7 @@ int pbg3Extract(wchar_t inDatName[], wchar_t outFolderName[], std::wstring renam
 }
 
 // Pack a PBG3 packfile
-int pbg3Pack(wchar_t inFolderName[], wchar_t outDatName[], bool removeExtension)
+int pbg3Pack(wchar_t inFolderName[], wchar_t outDatName[], bool removeExtension, int level)
 {
 	// Open output packfile for writing
 	FILE* outDat = _wfopen(outDatName, L"wb");
@@ -373,8 +376,10 @@ int pbg3Pack(wchar_t inFolderName[], wchar_t outDatName[], bool removeExtension)
 	fwrite(zeros, sizeof(char), 13, outDat);
 
 	std::vector<PBG3FileInfo> curr3FileInfos;
+	LZSSEncoder encoder;
+	long savedBytes = 0;
 	int searchPackResult = searchAndPack(inFolderName, outDat, curr3FileInfos, removeExtension,
-		inFolderName);
+		inFolderName, level, encoder, savedBytes);
 	if (searchPackResult != 0) {
 		return searchPackResult;
 	}
@@ -412,6 +417,9 @@ int pbg3Pack(wchar_t inFolderName[], wchar_t outDatName[], bool removeExtension)
 	fwrite(&headBuffer[0], headBuffer.size(), 1, outDat);
 	fclose(outDat);
 
+	if ((level & LZSS_LEVEL_MASK) == LZSS_LEVEL_OPTIMAL) {
+		printf("Optimal parsing saved %ld bytes over longest-match greedy parsing\n", savedBytes);
+	}
 	printf("Files successfully packed!\n");
 	return 0;
 }
\ No newline at end of file
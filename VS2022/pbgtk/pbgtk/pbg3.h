@@ -1,4 +1,4 @@
 #pragma once
 
 int pbg3Extract(wchar_t inDatName[], wchar_t outFolderName[], std::wstring renameType);
-int pbg3Pack(wchar_t inFolderName[], wchar_t outDatName[], bool removeExtension);
\ No newline at end of file
+int pbg3Pack(wchar_t inFolderName[], wchar_t outDatName[], bool removeExtension, int level);
\ No newline at end of file
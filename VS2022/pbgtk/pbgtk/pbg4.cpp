@@ -62,6 +62,10 @@ int pbg4Extract(wchar_t inDatName[], wchar_t outFolderName[])
 	uint8_t* decompressedTOC = decompress(compressedTOC, curr4Header.decompressedTOCSize,
 		compressedTOCSize, 13);
 	delete[] compressedTOC;
+	if (!decompressedTOC) {
+		printf("Corrupt table of contents!\n");
+		return -10;
+	}
 
 	// File TOC reading loop
 	PBG4FileInfo* curr4FileInfos = new PBG4FileInfo[curr4Header.numOfFiles]();
@@ -84,6 +88,7 @@ int pbg4Extract(wchar_t inDatName[], wchar_t outFolderName[])
 	delete[] decompressedTOC;
 
 	// File extraction loop
+	LZSSDecoder decoder;
 	for (uint32_t fileIndex = 0; fileIndex < curr4Header.numOfFiles; ++fileIndex) {
 		int byteCount = MultiByteToWideChar(932, 0, curr4FileInfos[fileIndex].filename, 
 			-1, NULL, 0);
@@ -108,10 +113,8 @@ int pbg4Extract(wchar_t inDatName[], wchar_t outFolderName[])
 				curr4FileInfos[fileIndex].offset;
 		}
 
-		// Read in compressed file data
-		uint8_t* currFileData = new uint8_t[compressedSize];
+		// Seek to compressed file data
 		fseek(inDat, curr4FileInfos[fileIndex].offset, SEEK_SET);
-		fread(currFileData, compressedSize, 1, inDat);
 
 		// Set output path and write decompressed file
 		wchar_t outPath[MAX_PATH];
@@ -122,12 +125,13 @@ int pbg4Extract(wchar_t inDatName[], wchar_t outFolderName[])
 			printf("Failed to open output file!\n");
 			return -8;
 		}
-		uint8_t* decompressedFile = decompress(currFileData, 
-			curr4FileInfos[fileIndex].uncompressedSize, compressedSize, 13);
-		fwrite(decompressedFile, curr4FileInfos[fileIndex].uncompressedSize, 1, outFile);
+		if (!decoder.Extract(inDat, compressedSize, outFile,
+			curr4FileInfos[fileIndex].uncompressedSize, 13)) {
+			fclose(outFile);
+			printf("Corrupt file data!\n");
+			return -10;
+		}
 		fclose(outFile);
-		delete[] currFileData;
-		delete[] decompressedFile;
 	}
 
 	fclose(inDat);
@@ -136,7 +140,7 @@ int pbg4Extract(wchar_t inDatName[], wchar_t outFolderName[])
 }
 
 // Pack a PBG4 packfile
-int pbg4Pack(wchar_t inFolderName[], wchar_t outDatName[])
+int pbg4Pack(wchar_t inFolderName[], wchar_t outDatName[], int level)
 {
 	WIN32_FIND_DATAW ffd;
 	HANDLE hFind = INVALID_HANDLE_VALUE;
@@ -174,6 +178,8 @@ int pbg4Pack(wchar_t inFolderName[], wchar_t outDatName[])
 	hFind = FindFirstFileW(searchPath, &ffd);
 
 	uint32_t fileIndex = 0;
+	LZSSEncoder encoder;
+	long savedBytes = 0;
 	struct _stat s;
 	// File packing loop
 	do {
@@ -208,8 +214,10 @@ int pbg4Pack(wchar_t inFolderName[], wchar_t outDatName[])
 			// Read in and compress file data
 			uint8_t* currFileData = new uint8_t[curr4FileInfo.uncompressedSize]();
 			fread(currFileData, curr4FileInfo.uncompressedSize, 1, inFile);
-			std::vector<uint8_t> compressedData = compress(currFileData, 
-				curr4FileInfo.uncompressedSize, 13);
+			size_t greedySize = 0;
+			std::vector<uint8_t> compressedData = encoder.Compress(currFileData, 
+				curr4FileInfo.uncompressedSize, 13, level, &greedySize);
+			savedBytes += (long)(greedySize - compressedData.size());
 			// Write compressed data to packfile
 			fwrite(&compressedData[0], compressedData.size(), 1, outDat);
 			delete[] currFileData;
@@ -243,7 +251,10 @@ int pbg4Pack(wchar_t inFolderName[], wchar_t outDatName[])
 	}
 
 	// Compress and write table of contents
-	std::vector<uint8_t> compressedData = compress(toCompress, curr4Header.decompressedTOCSize, 13);
+	size_t greedySize = 0;
+	std::vector<uint8_t> compressedData = encoder.Compress(toCompress, curr4Header.decompressedTOCSize, 13, level,
+		&greedySize);
+	savedBytes += (long)(greedySize - compressedData.size());
 	fwrite(&compressedData[0], compressedData.size(), 1, outDat);
 
 	// Rewrite proper header
@@ -252,6 +263,9 @@ int pbg4Pack(wchar_t inFolderName[], wchar_t outDatName[])
 	fwrite(&curr4Header, sizeof(PBG4Header), 1, outDat);
 	fclose(outDat);
 
+	if ((level & LZSS_LEVEL_MASK) == LZSS_LEVEL_OPTIMAL) {
+		printf("Optimal parsing saved %ld bytes over longest-match greedy parsing\n", savedBytes);
+	}
 	printf("Files successfully packed!\n");
 	return 0;
 }
\ No newline at end of file
@@ -1,4 +1,4 @@
 #pragma once
 
 int pbg5Extract(wchar_t inDatName[], wchar_t outFolderName[]);
-int pbg5Pack(wchar_t inFolderName[], wchar_t outDatName[]);
\ No newline at end of file
+int pbg5Pack(wchar_t inFolderName[], wchar_t outDatName[], int level);
\ No newline at end of file
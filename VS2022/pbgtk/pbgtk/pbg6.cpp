@@ -11,11 +11,41 @@
 #include <string>
 #include <vector>
 #include "crc32.h"
-
-const unsigned long CP1_SIZE = 0x102;
-const unsigned long CP2_SIZE = 0x400;
-unsigned long pool1[CP1_SIZE];
-unsigned long pool2[CP2_SIZE];
+#include "cpu.h"
+#include "bench.h"
+
+// Adaptive order-0 model of the range coder, over 0x100 byte values and
+// the end marker. pool2 holds the frequency of every symbol. Instead of one
+// array of cumulative frequencies, which every update has to walk from the
+// symbol to the end, the symbols are split into blocks of CP_BLOCK_SIZE:
+// poolBlock holds the total of all blocks in front of each block (and the
+// overall total at the end), and poolInner the total of the symbols in
+// front of each one within its block. An update then only has to touch the
+// rest of one block and the block totals after it.
+// The symbols past the end marker that pad out the last block never occur,
+// and keep a frequency of 0. All of these are 32-bit, so that the decoder
+// can compare 4 of them at once with SSE2, if [simd] is set.
+const uint32_t CP_SYMBOLS = 0x101;
+const uint32_t CP_BLOCK_BITS = 4;
+const uint32_t CP_BLOCK_SIZE = (1 << CP_BLOCK_BITS);
+const uint32_t CP_BLOCKS = ((CP_SYMBOLS + CP_BLOCK_SIZE - 1) >> CP_BLOCK_BITS);
+const uint32_t CP2_SIZE = (CP_BLOCKS << CP_BLOCK_BITS);
+
+struct CryptPools {
+	uint32_t poolBlock[CP_BLOCKS + 1];
+	uint32_t poolInner[CP2_SIZE];
+	uint32_t pool2[CP2_SIZE];
+	bool simd;
+
+	void Init(const bool useSSE2);
+	void Build();
+	uint32_t Find(const uint32_t target) const;
+	void Step(const uint32_t sym);
+
+	// Total frequency of all symbols below [sym]
+	uint32_t CumFreq(const uint32_t sym) const { return poolBlock[sym >> CP_BLOCK_BITS] + poolInner[sym]; }
+	uint32_t Total() const { return poolBlock[CP_BLOCKS]; }
+};
 
 struct PBG6Header {
 	uint32_t magic;	// PBG6
@@ -32,104 +62,319 @@ struct PBG6FileInfo {
 	uint32_t decompressedCRCSum;
 };
 
-inline unsigned long EndianSwap(const unsigned long& x)
-{
-	return ((x & 0x000000ff) << 24) |
-		((x & 0x0000ff00) << 8) |
-		((x & 0x00ff0000) >> 8) |
-		((x & 0xff000000) >> 24);
-}
+// Number of entries that PBG6Codec::DecodeGroup() decodes at once
+const unsigned int PBG6_DECODE_STREAMS = 4;
 
-void InitCryptPools()
-{
-	for (unsigned long c = 0; c < CP1_SIZE; c++)	pool1[c] = c;
-	for (unsigned long c = 0; c < CP2_SIZE; c++)	pool2[c] = 1;
-}
+// Number of bytes that PBG6Codec::DecodeGroup() decodes of each entry
+// before adding them to its CRC, while they are still in the cache
+const uint32_t PBG6_CRC_BLOCK = 0x4000;
 
-void CryptStep(unsigned long& sym)
-{
-	static const unsigned long cmp = (CP1_SIZE - 1);
+// One entry for PBG6Codec::DecodeGroup()
+struct PBG6Job {
+	const char* source;
+	char* decompressed;
+	uint32_t destsize;
+	uint32_t sourcesize;
+	uint32_t crc;	// Set by DecodeGroup() to the CRC32 of the decoded data
+};
 
-	pool2[sym]++;
-	sym++;
-	while (sym <= cmp)
+// Whether the CPU has SSE2, decided before main() starts any threads
+#ifdef PBGTK_SSE2
+static const bool sse2 = cpu::has_sse2();
+#else
+static const bool sse2 = false;
+#endif
+
+// Range coder context. Holds a model, and scratch buffers for the
+// compressed and decompressed data of an entry, for each of up to
+// PBG6_DECODE_STREAMS entries, grown to the largest entries seen so far.
+// Nothing is shared between contexts, so each thread can use its own.
+// Its models use SSE2 if [useSSE2] was set on construction.
+class PBG6Codec {
+	CryptPools pools[PBG6_DECODE_STREAMS];
+	bool simd;
+	char* input[PBG6_DECODE_STREAMS];
+	uint32_t inputCapacity[PBG6_DECODE_STREAMS];
+	char* output[PBG6_DECODE_STREAMS];
+	uint32_t outputCapacity[PBG6_DECODE_STREAMS];
+	std::vector<char> encoded;
+
+	static char* Grow(char*& buffer, uint32_t& capacity, const uint32_t size)
 	{
-		pool1[sym]++;
-		sym++;
+		if (size > capacity) {
+			delete[] buffer;
+			buffer = new char[size];
+			capacity = size;
+		}
+		return buffer;
+	}
+
+	// Appends the top byte of [low] to the encoded data
+	void EmitTop(size_t& size, const uint32_t low)
+	{
+		if (size == encoded.size()) {
+			encoded.resize(size * 2);
+		}
+		encoded[size++] = (char)(low >> 24);
+	}
+
+	// Not copyable, as it owns its buffers
+	PBG6Codec(const PBG6Codec&);
+	PBG6Codec& operator =(const PBG6Codec&);
+
+public:
+	PBG6Codec(const bool useSSE2 = sse2) {
+		simd = useSSE2;
+		for (unsigned int i = 0; i < PBG6_DECODE_STREAMS; i++) {
+			input[i] = NULL;
+			inputCapacity[i] = 0;
+			output[i] = NULL;
+			outputCapacity[i] = 0;
+		}
+	}
+
+	~PBG6Codec() {
+		for (unsigned int i = 0; i < PBG6_DECODE_STREAMS; i++) {
+			delete[] input[i];
+			delete[] output[i];
+		}
 	}
 
-	if (pool1[cmp] < 0x10000)	return;
+	char* InputBuffer(const uint32_t size, const unsigned int slot = 0) { return Grow(input[slot], inputCapacity[slot], size); }
+	char* OutputBuffer(const uint32_t size, const unsigned int slot = 0) { return Grow(output[slot], outputCapacity[slot], size); }
 
-	pool1[0] = 0;
+	uint32_t Decode(const char* source, char* decompressed, const uint32_t destsize, const uint32_t sourcesize);
+	void DecodeGroup(PBG6Job* jobs, unsigned int count);
+	const std::vector<char>& Encode(const char* source, const uint32_t sourcesize);
+};
 
-	for (unsigned short c = 0; c < cmp; c++)
+// Rebuilds the cumulative frequencies from pool2
+void CryptPools::Build()
+{
+	uint32_t total = 0;
+#ifdef PBGTK_SSE2
+	if (simd)
 	{
-		pool2[c] = (pool2[c] | 2) >> 1;
-		pool1[c + 1] = pool1[c] + pool2[c];
+		// Running totals of 4 frequencies at a time, each one carrying on
+		// from the last total of the one before
+		for (uint32_t b = 0; b < CP_BLOCKS; b++)
+		{
+			const __m128i* freq = (const __m128i*)(pool2 + (b << CP_BLOCK_BITS));
+			__m128i* inner = (__m128i*)(poolInner + (b << CP_BLOCK_BITS));
+			__m128i carry = _mm_setzero_si128();
+			poolBlock[b] = total;
+			for (int i = 0; i < 4; i++)
+			{
+				const __m128i f = _mm_loadu_si128(freq + i);
+				__m128i sum = _mm_add_epi32(f, _mm_slli_si128(f, 4));
+				sum = _mm_add_epi32(sum, _mm_slli_si128(sum, 8));
+				sum = _mm_add_epi32(sum, carry);
+				_mm_storeu_si128(inner + i, _mm_sub_epi32(sum, f));
+				carry = _mm_shuffle_epi32(sum, _MM_SHUFFLE(3, 3, 3, 3));
+			}
+			total += (uint32_t)_mm_cvtsi128_si32(carry);
+		}
+		poolBlock[CP_BLOCKS] = total;
+		return;
 	}
+#endif
 
-	return;
+	for (uint32_t b = 0; b < CP_BLOCKS; b++)
+	{
+		uint32_t inner = 0;
+		poolBlock[b] = total;
+		for (uint32_t c = (b << CP_BLOCK_BITS); c < ((b + 1) << CP_BLOCK_BITS); c++)
+		{
+			poolInner[c] = inner;
+			inner += pool2[c];
+		}
+		total += inner;
+	}
+	poolBlock[CP_BLOCKS] = total;
 }
 
-// Range coder decompression for PBG6
-char* decrypt(const char* source, const unsigned long& destsize, const unsigned long& sourcesize)
+void CryptPools::Init(const bool useSSE2)
 {
-	unsigned long ebx = 0, ecx, edi, esi, edx;
-	unsigned long cryptval[2] = { 0 };
-	unsigned long s = 4, d = 0;	// source and destination bytes
-	char* decompressed = new char[destsize];
+	simd = useSSE2;
+	for (uint32_t c = 0; c < CP2_SIZE; c++)	pool2[c] = (c < CP_SYMBOLS) ? 1 : 0;
+	Build();
+}
 
-	InitCryptPools();
+#ifdef PBGTK_SSE2
+// Number of the 16 values at [values] that are at most [target]. The
+// frequencies stay below 0x10000 + 1, so a signed compare works.
+inline uint32_t CountAtMost16(const uint32_t* values, const __m128i target)
+{
+	__m128i above = _mm_setzero_si128();
+	for (int i = 0; i < 16; i += 4)
+	{
+		above = _mm_sub_epi32(above,
+			_mm_cmpgt_epi32(_mm_loadu_si128((const __m128i*)(values + i)), target));
+	}
+	above = _mm_add_epi32(above, _mm_shuffle_epi32(above, _MM_SHUFFLE(1, 0, 3, 2)));
+	above = _mm_add_epi32(above, _mm_shuffle_epi32(above, _MM_SHUFFLE(2, 3, 0, 1)));
+	return 16 - _mm_cvtsi128_si32(above);
+}
+#endif
+
+// Returns the symbol whose range of cumulative frequencies contains
+// [target], which has to be less than Total(). As the cumulative
+// frequencies are sorted, the block is the number of block totals after
+// the first that are at most [target], and the same goes for the symbol
+// within the block. Counting them doesn't depend on the data to decide
+// which entry to look at next, unlike a binary search, whose branches are
+// about as predictable as the data being decoded.
+uint32_t CryptPools::Find(const uint32_t target) const
+{
+	uint32_t block = 0, sym = 0;
+#ifdef PBGTK_SSE2
+	if (simd)
+	{
+		// 16 block totals after the first, and 16 symbols per block
+		block = CountAtMost16(poolBlock + 1, _mm_set1_epi32((int)target));
+		const uint32_t inner = target - poolBlock[block];
+		sym = (block << CP_BLOCK_BITS) - 1 +
+			CountAtMost16(poolInner + (block << CP_BLOCK_BITS), _mm_set1_epi32((int)inner));
+	}
+	else
+#endif
+	{
+		for (uint32_t b = 1; b < CP_BLOCKS; b++)
+		{
+			block += (poolBlock[b] <= target);
+		}
+		const uint32_t inner = target - poolBlock[block];
+		sym = (block << CP_BLOCK_BITS);
+		for (uint32_t c = 1; c < CP_BLOCK_SIZE; c++)
+		{
+			sym += (poolInner[(block << CP_BLOCK_BITS) + c] <= inner);
+		}
+	}
 
-	edi = EndianSwap(*(unsigned long*)source);
-	esi = 0xFFFFFFFF;
+	// The padding symbols at the end have no range of their own
+	return (sym < CP_SYMBOLS) ? sym : (CP_SYMBOLS - 1);
+}
 
-	while (1)
+void CryptPools::Step(const uint32_t sym)
+{
+	uint32_t c = 0;
+	pool2[sym]++;
+	const uint32_t block = (sym >> CP_BLOCK_BITS);
+#ifdef PBGTK_SSE2
+	if (simd)
 	{
-		edx = 0x100;
-
-		cryptval[0] = esi / pool1[0x101];
-		cryptval[1] = (edi - ebx) / cryptval[0];
+		// Comparing the position of every entry in the symbol's block, and
+		// of every block total after the first, with that of the symbol
+		// gives -1 for the ones after it, and subtracting that adds 1.
+		// The overall total always goes up.
+		__m128i* inner = (__m128i*)(poolInner + (block << CP_BLOCK_BITS));
+		__m128i* blocks = (__m128i*)(poolBlock + 1);
+		const __m128i symPos = _mm_set1_epi32((int)(sym & (CP_BLOCK_SIZE - 1)));
+		const __m128i blockPos = _mm_set1_epi32((int)block - 1);
+		__m128i pos = _mm_setr_epi32(0, 1, 2, 3);
+		for (int i = 0; i < 4; i++)
+		{
+			_mm_storeu_si128(inner + i,
+				_mm_sub_epi32(_mm_loadu_si128(inner + i), _mm_cmpgt_epi32(pos, symPos)));
+			_mm_storeu_si128(blocks + i,
+				_mm_sub_epi32(_mm_loadu_si128(blocks + i), _mm_cmpgt_epi32(pos, blockPos)));
+			pos = _mm_add_epi32(pos, _mm_set1_epi32(4));
+		}
+		poolBlock[CP_BLOCKS]++;
+	}
+	else
+#endif
+	{
+		for (c = sym + 1; c < ((block + 1) << CP_BLOCK_BITS); c++)
+		{
+			poolInner[c]++;
+		}
+		for (uint32_t b = block + 1; b <= CP_BLOCKS; b++)
+		{
+			poolBlock[b]++;
+		}
+	}
 
-		ecx = 0x80;
-		esi = 0;
+	if (Total() < 0x10000)	return;
 
-		while (1)
+	// Halve the frequencies, keeping them at 1 or more. The padding
+	// symbols after the end marker have to stay at 0.
+	c = 0;
+#ifdef PBGTK_SSE2
+	if (simd)
+	{
+		const __m128i two = _mm_set1_epi32(2);
+		for (; (c + 4) <= CP_SYMBOLS; c += 4)
 		{
-			while ((ecx != 0x100) && (pool1[ecx] > cryptval[1]))
-			{
-				ecx--;
-				edx = ecx;
-				ecx = (esi + ecx) >> 1;
-			}
+			__m128i* freq = (__m128i*)(pool2 + c);
+			_mm_storeu_si128(freq, _mm_srli_epi32(_mm_or_si128(_mm_loadu_si128(freq), two), 1));
+		}
+	}
+#endif
+	for (; c < CP_SYMBOLS; c++)
+	{
+		pool2[c] = (pool2[c] | 2) >> 1;
+	}
+	Build();
 
-			if (cryptval[1] < pool1[ecx + 1])	break;
+	return;
+}
 
-			esi = ecx + 1;
-			ecx = (esi + edx) >> 1;
-		}
+// State of one range decoder stream, named after the registers of the
+// original x86 code: the low end of the range in [ebx], its size in [esi],
+// and the code read so far in [edi]. All arithmetic is on 32 bits,
+// wrapping around as the original code does.
+struct PBG6Stream {
+	const char* source;
+	const char* end;
+	char* dest;
+	uint32_t ebx, edi, esi;
+
+	void Begin(const char* src, const uint32_t srcsize, char* dst)
+	{
+		source = src;
+		end = (src + srcsize);
+		dest = dst;
+		ebx = 0;
+		edi = 0;
+		for (int i = 0; i < 4; i++)	edi = (edi << 8) + NextByte();
+		esi = 0xFFFFFFFF;
+	}
 
-		*(decompressed + d) = (char)ecx;	// Write!
-		if (++d >= destsize)	return decompressed;
+	// Returns the next code byte, or 0 past the end of the compressed
+	// data. A corrupt entry then just decodes to garbage, which fails its
+	// CRC check.
+	inline uint32_t NextByte()
+	{
+		return (source < end) ? (uint32_t)(unsigned char)*source++ : 0;
+	}
 
-		esi = (long)pool2[ecx] * (long)cryptval[0];	// IMUL
+	// Decodes and writes the next symbol, and returns it along with the
+	// range per unit of frequency in [scale]
+	inline uint32_t Decode(const CryptPools& pools, uint32_t& scale)
+	{
+		scale = esi / pools.Total();
+		const uint32_t sym = pools.Find((edi - ebx) / scale);
+		*dest++ = (char)sym;	// Write!
+		return sym;
+	}
 
-		ebx += pool1[ecx] * cryptval[0];
-		CryptStep(ecx);
+	// Decodes the next symbol, then narrows the range down to it, updates
+	// the model and reads in as many code bytes as that frees up
+	inline void Step(CryptPools& pools)
+	{
+		uint32_t scale;
+		const uint32_t sym = Decode(pools, scale);
 
-		ecx = (ebx + esi) ^ ebx;
+		esi = pools.pool2[sym] * scale;	// IMUL, keeping the low 32 bits
+		ebx += pools.CumFreq(sym) * scale;
+		pools.Step(sym);
 
-		while (!(ecx & 0xFF000000))
+		while (!(((ebx + esi) ^ ebx) & 0xFF000000))
 		{
 			ebx <<= 8;
 			esi <<= 8;
-			edi <<= 8;
-
-			ecx = (ebx + esi) ^ ebx;
-
-			edi += *(source + s) & 0x000000FF;
-			s++;
-			// if(++s >= sourcesize)	return true;
+			edi = (edi << 8) + NextByte();
 		}
 
 		while (esi < 0x10000)
@@ -138,52 +383,148 @@ char* decrypt(const char* source, const unsigned long& destsize, const unsigned
 
 			ebx <<= 8;
 			esi <<= 8;
-			edi <<= 8;
+			edi = (edi << 8) + NextByte();
+		}
+	}
+};
+
+// Steps [N] streams, each with its own model, [steps] times. Each stream
+// has one long chain of dependent divisions, lookups and model updates per
+// symbol, and taking one symbol from each in turn lets the out-of-order
+// core work on the others while one of them waits.
+template <unsigned int N>
+static void DecodeInterleaved(PBG6Stream* streams, CryptPools** models, uint32_t steps)
+{
+	// Work on local copies, which the compiler can keep in registers
+	PBG6Stream stream[N];
+	unsigned int i;
+	for (i = 0; i < N; i++)	stream[i] = streams[i];
+	while (steps--)
+	{
+		for (i = 0; i < N; i++)	stream[i].Step(*models[i]);
+	}
+	for (i = 0; i < N; i++)	streams[i] = stream[i];
+}
+
+// Range coder decompression for PBG6 of the [sourcesize] bytes at
+// [source], into a caller-provided buffer of [destsize] bytes. Returns the
+// CRC32 of the decoded data.
+uint32_t PBG6Codec::Decode(const char* source, char* decompressed, const uint32_t destsize, const uint32_t sourcesize)
+{
+	PBG6Job job = { source, decompressed, destsize, sourcesize, 0 };
+	DecodeGroup(&job, 1);
+	return job.crc;
+}
+
+// Decodes up to PBG6_DECODE_STREAMS independent entries at once, as
+// Decode() would decode each of them, interleaving their symbols for as
+// long as more than one of them is left
+void PBG6Codec::DecodeGroup(PBG6Job* jobs, unsigned int count)
+{
+	PBG6Stream streams[PBG6_DECODE_STREAMS];
+	CryptPools* models[PBG6_DECODE_STREAMS];
+	uint32_t left[PBG6_DECODE_STREAMS];
+	PBG6Job* owners[PBG6_DECODE_STREAMS];
+	const char* checked[PBG6_DECODE_STREAMS];	// end of the data in the CRC so far
+	unsigned int active = 0, i;
+
+	if (count > PBG6_DECODE_STREAMS)	count = PBG6_DECODE_STREAMS;
+	for (i = 0; i < count; i++)
+	{
+		jobs[i].crc = 0;
+		if (jobs[i].destsize == 0)	continue;
+		pools[i].Init(simd);
+		streams[active].Begin(jobs[i].source, jobs[i].sourcesize, jobs[i].decompressed);
+		models[active] = &pools[i];
+		left[active] = jobs[i].destsize - 1;
+		owners[active] = &jobs[i];
+		checked[active] = jobs[i].decompressed;
+		active++;
+	}
+
+	while (active != 0)
+	{
+		// Run all streams up to the end of the shortest one, or for one
+		// CRC block...
+		uint32_t steps = PBG6_CRC_BLOCK;
+		for (i = 0; i < active; i++)	steps = (left[i] < steps) ? left[i] : steps;
+		switch (active)
+		{
+			case 1:	DecodeInterleaved<1>(streams, models, steps);	break;
+			case 2:	DecodeInterleaved<2>(streams, models, steps);	break;
+			case 3:	DecodeInterleaved<3>(streams, models, steps);	break;
+			default:	DecodeInterleaved<4>(streams, models, steps);	break;
+		}
 
-			edi += *(source + s) & 0x000000FF;
-			s++;
-			// if(++s >= sourcesize)	return true;
+		// ...and decode the last symbol of any that end there. That one
+		// doesn't need the model update or any further code bytes.
+		for (i = 0; i < active; )
+		{
+			left[i] -= steps;
+			if (left[i] == 0)
+			{
+				uint32_t scale;
+				streams[i].Decode(*models[i], scale);
+			}
+			owners[i]->crc = crc32::update(owners[i]->crc, checked[i], streams[i].dest - checked[i]);
+			checked[i] = streams[i].dest;
+			if (left[i] != 0)
+			{
+				i++;
+				continue;
+			}
+			active--;
+			streams[i] = streams[active];
+			models[i] = models[active];
+			left[i] = left[active];
+			owners[i] = owners[active];
+			checked[i] = checked[active];
 		}
 	}
 }
 
 // PBG6 compressor (carryless range coder)
-// Uses two frequency tables (pool1 for cumulative, pool2 for symbol)
-std::vector<char> encrypt(const char* source, const unsigned long& sourcesize)
+// Uses the frequency model above (cumulative and per-symbol frequencies).
+// The returned data stays valid until the next call.
+const std::vector<char>& PBG6Codec::Encode(const char* source, const uint32_t sourcesize)
 {
-	const unsigned long TOP = 0x01000000;
-	const unsigned long BOT = 0x00010000;
+	const uint32_t TOP = 0x01000000;
+	const uint32_t BOT = 0x00010000;
 
-	std::vector<char> dest;
+	// Room for a little more than the input, which is as far as data that
+	// doesn't compress gets; anything beyond that grows the buffer
+	size_t size = 0;
+	encoded.resize(sourcesize + (sourcesize >> 6) + 16);
 
 	// Initialize model
-	InitCryptPools();
+	CryptPools& model = pools[0];
+	model.Init(simd);
 
-	unsigned long low = 0;
-	unsigned long range = 0xFFFFFFFF;
+	uint32_t low = 0;
+	uint32_t range = 0xFFFFFFFF;
 
 	// For the number of bytes in the file (plus one for EOF)
-	for (unsigned long byteIndex = 0; byteIndex <= sourcesize; ++byteIndex) {
+	for (uint32_t byteIndex = 0; byteIndex <= sourcesize; ++byteIndex) {
 		// Store symbol to encode (with extra 256 for EOF)
-		unsigned long sym = (byteIndex != sourcesize) ? (unsigned char)source[byteIndex] : 256;
+		uint32_t sym = (byteIndex != sourcesize) ? (unsigned char)source[byteIndex] : 256;
 
 		// Store total frequency
-		unsigned long total = pool1[CP1_SIZE - 1];  // pool1[0x101]
+		uint32_t total = model.Total();
 
 		// Scale range by total
-		unsigned long rangeByTotal = range / total;
+		uint32_t rangeByTotal = range / total;
 
 		// Update arithmetic coding
-		low += pool1[sym] * rangeByTotal;
-		range = pool2[sym] * rangeByTotal;
+		low += model.CumFreq(sym) * rangeByTotal;
+		range = model.pool2[sym] * rangeByTotal;
 
 		// Ensure high bytes of low and low + range differ
 		while (1) {
-			unsigned long lowRangeDiff = (low + range) ^ low;
+			uint32_t lowRangeDiff = (low + range) ^ low;
 			if (lowRangeDiff & 0xFF000000) break;
 
 			// Emit the stable top byte
-			dest.push_back((char)((low >> 24) & 0xFF));
+			EmitTop(size, low);
 
 			low <<= 8;
 			range <<= 8;
@@ -193,7 +534,7 @@ std::vector<char> encrypt(const char* source, const unsigned long& sourcesize)
 		while (range < BOT) {
 			range = BOT - (low & 0xFFFF);
 
-			dest.push_back((char)((low >> 24) & 0xFF));
+			EmitTop(size, low);
 
 			low <<= 8;
 			range <<= 8;
@@ -202,17 +543,18 @@ std::vector<char> encrypt(const char* source, const unsigned long& sourcesize)
 		// If not EOF
 		if (sym != 256) {
 			// Update model
-			CryptStep(sym);
+			model.Step(sym);
 		}
 	}
 
 	// Push 4 more bytes of low
 	for (uint32_t iter = 0; iter < 4; ++iter) {
-		dest.push_back((char)((low >> 24) & 0xFF));
+		EmitTop(size, low);
 		low <<= 8;
 	}
 
-	return dest;
+	encoded.resize(size);
+	return encoded;
 }
 
 // Extract a PBG6 packfile
@@ -244,15 +586,27 @@ int pbg6Extract(wchar_t inDatName[], wchar_t outFolderName[])
 	// packfile size and TOC offset
 	struct _stat s;
 	_wstat(inDatName, &s);
+	if ((curr6Header.tocOffset < sizeof(PBG6Header)) || (curr6Header.tocOffset > (uint32_t)s.st_size) ||
+		(curr6Header.decompressedTOCSize < sizeof(uint32_t))) {
+		printf("Not a valid packfile!\n");
+		return -2;
+	}
 	size_t compressedTOCSize = s.st_size - curr6Header.tocOffset;
 
 	// Read in and decompress table of contents
+	PBG6Codec codec;
 	char* compressedTOC = new char[compressedTOCSize];
 	fseek(inDat, curr6Header.tocOffset, SEEK_SET);
 	fread(compressedTOC, compressedTOCSize, 1, inDat);
-	char* decompressedTOC = decrypt(compressedTOC, 
+	char* decompressedTOC = new char[curr6Header.decompressedTOCSize];
+	const uint32_t tocCRC = codec.Decode(compressedTOC, decompressedTOC, 
 		curr6Header.decompressedTOCSize, compressedTOCSize);
 	delete[] compressedTOC;
+	if (tocCRC != curr6Header.decompressedTOCChecksum) {
+		delete[] decompressedTOC;
+		printf("Table of contents failed the CRC check!\n");
+		return -11;
+	}
 
 	//File TOC reading loop
 	uint32_t numOfFiles = *(uint32_t*)(decompressedTOC);
@@ -277,39 +631,76 @@ int pbg6Extract(wchar_t inDatName[], wchar_t outFolderName[])
 	}
 	delete[] decompressedTOC;
 
-	// File extraction loop
+	// The table of contents passed its CRC check, but the packfile can still
+	// be cut short before the data of its entries
+	uint32_t badEntries = 0;
 	for (uint32_t fileIndex = 0; fileIndex < numOfFiles; ++fileIndex) {
-		int byteCount = MultiByteToWideChar(932, 0, curr6FileInfos[fileIndex].filename, -1, NULL, 0);
-		wchar_t* wideFilename = new wchar_t[byteCount];
-		// Store filename as wide char with proper Shift-JIS encoding
-		MultiByteToWideChar(932, 0, curr6FileInfos[fileIndex].filename, 
-			strlen(curr6FileInfos[fileIndex].filename) + 1, wideFilename, byteCount);
-
-		printf("Unpacking %s...\n", curr6FileInfos[fileIndex].filename);
-
-		// Read in compressed file data
-		char* currFileData = new char[curr6FileInfos[fileIndex].compressedSize];
-		fseek(inDat, curr6FileInfos[fileIndex].offset, SEEK_SET);
-		fread(currFileData, curr6FileInfos[fileIndex].compressedSize, 1, inDat);
-
-		// Set output path and write decompressed file
-		wchar_t outPath[MAX_PATH];
-		swprintf(outPath, L"%ls\\%ls", outFolderName, wideFilename);
-		delete[] wideFilename;
-		FILE* outFile = _wfopen(outPath, L"wb");
-		if (!outFile) {
-			printf("Failed to open output file!\n");
-			return -8;
+		const PBG6FileInfo& info = curr6FileInfos[fileIndex];
+		if ((info.offset < sizeof(PBG6Header)) || (info.offset > curr6Header.tocOffset) ||
+			(info.compressedSize > (curr6Header.tocOffset - info.offset))) {
+			printf("%s lies outside the packfile!\n", info.filename);
+			++badEntries;
+		}
+	}
+	if (badEntries != 0) {
+		printf("Packfile is truncated or corrupt!\n");
+		return -10;
+	}
+
+	// File extraction loop, decoding PBG6_DECODE_STREAMS files at a time
+	uint32_t failedFiles = 0;
+	for (uint32_t fileIndex = 0; fileIndex < numOfFiles; ) {
+		PBG6Job group[PBG6_DECODE_STREAMS];
+		FILE* outFiles[PBG6_DECODE_STREAMS];
+		unsigned int groupSize = 0;
+		for (; (groupSize < PBG6_DECODE_STREAMS) && (fileIndex < numOfFiles); ++groupSize, ++fileIndex) {
+			int byteCount = MultiByteToWideChar(932, 0, curr6FileInfos[fileIndex].filename, -1, NULL, 0);
+			wchar_t* wideFilename = new wchar_t[byteCount];
+			// Store filename as wide char with proper Shift-JIS encoding
+			MultiByteToWideChar(932, 0, curr6FileInfos[fileIndex].filename, 
+				strlen(curr6FileInfos[fileIndex].filename) + 1, wideFilename, byteCount);
+
+			printf("Unpacking %s...\n", curr6FileInfos[fileIndex].filename);
+
+			// Read in compressed file data
+			char* currFileData = codec.InputBuffer(curr6FileInfos[fileIndex].compressedSize, groupSize);
+			fseek(inDat, curr6FileInfos[fileIndex].offset, SEEK_SET);
+			fread(currFileData, curr6FileInfos[fileIndex].compressedSize, 1, inDat);
+
+			// Set output path and open output file
+			wchar_t outPath[MAX_PATH];
+			swprintf(outPath, L"%ls\\%ls", outFolderName, wideFilename);
+			delete[] wideFilename;
+			outFiles[groupSize] = _wfopen(outPath, L"wb");
+			if (!outFiles[groupSize]) {
+				printf("Failed to open output file!\n");
+				return -8;
+			}
+			group[groupSize].source = currFileData;
+			group[groupSize].decompressed = codec.OutputBuffer(curr6FileInfos[fileIndex].decompressedSize, groupSize);
+			group[groupSize].destsize = curr6FileInfos[fileIndex].decompressedSize;
+			group[groupSize].sourcesize = curr6FileInfos[fileIndex].compressedSize;
+		}
+
+		// Decompress and write the files of this group, and check them
+		// against the CRCs in the table of contents
+		codec.DecodeGroup(group, groupSize);
+		for (unsigned int i = 0; i < groupSize; ++i) {
+			fwrite(group[i].decompressed, group[i].destsize, 1, outFiles[i]);
+			fclose(outFiles[i]);
+			const PBG6FileInfo& info = curr6FileInfos[fileIndex - groupSize + i];
+			if (group[i].crc != info.decompressedCRCSum) {
+				printf("%s failed the CRC check!\n", info.filename);
+				++failedFiles;
+			}
 		}
-		char* decompressedFile = decrypt(currFileData, curr6FileInfos[fileIndex].decompressedSize,
-			curr6FileInfos[fileIndex].compressedSize);
-		fwrite(decompressedFile, curr6FileInfos[fileIndex].decompressedSize, 1, outFile);
-		delete[] currFileData;
-		delete[] decompressedFile;
-		fclose(outFile);
 	}
 
 	fclose(inDat);
+	if (failedFiles != 0) {
+		printf("%u files failed the CRC check!\n", failedFiles);
+		return -11;
+	}
 	printf("Files successfully extracted!\n");
 	return 0;
 }
@@ -355,6 +746,7 @@ int pbg6Pack(wchar_t inFolderName[], wchar_t outDatName[])
 	PBG6FileInfo* curr6FileInfos = new PBG6FileInfo[numOfFiles]();
 	hFind = FindFirstFileW(searchPath, &ffd);
 	uint32_t fileIndex = 0;
+	PBG6Codec codec;
 	struct _stat s;
 	do {
 		// Make sure this file is not hidden, a directory, or ./..
@@ -391,15 +783,13 @@ int pbg6Pack(wchar_t inFolderName[], wchar_t outDatName[])
 			// Write compressed file to packfile
 			char* currFileData = new char[curr6FileInfo.decompressedSize];
 			fread(currFileData, curr6FileInfo.decompressedSize, 1, inFile);
-			std::vector<char> compressedFileData = encrypt(currFileData, 
+			const std::vector<char>& compressedFileData = codec.Encode(currFileData, 
 				curr6FileInfo.decompressedSize);
 			curr6FileInfo.compressedSize = compressedFileData.size();
 			fwrite(&compressedFileData[0], curr6FileInfo.compressedSize, 1, outDat);
 			
 			// Calculate CRC32 checksum of decompressed file
-			uint32_t table[256];
-			crc32::generate_table(table);
-			curr6FileInfo.decompressedCRCSum = crc32::update(table, 0, currFileData, 
+			curr6FileInfo.decompressedCRCSum = crc32::update(0, currFileData, 
 				curr6FileInfo.decompressedSize);
 			delete[] currFileData;
 
@@ -441,11 +831,9 @@ int pbg6Pack(wchar_t inFolderName[], wchar_t outDatName[])
 	}
 
 	// Calculate CRC32 checksum of decompressed table of contents
-	uint32_t table[256];
-	crc32::generate_table(table);
-	curr6Header.decompressedTOCChecksum = crc32::update(table, 0, toCompress, 
+	curr6Header.decompressedTOCChecksum = crc32::update(0, toCompress, 
 		curr6Header.decompressedTOCSize);
-	std::vector<char> compressedTOC = encrypt(toCompress, curr6Header.decompressedTOCSize);
+	const std::vector<char>& compressedTOC = codec.Encode(toCompress, curr6Header.decompressedTOCSize);
 	delete[] toCompress;
 	fwrite(&compressedTOC[0], compressedTOC.size(), 1, outDat);
 
@@ -457,4 +845,127 @@ int pbg6Pack(wchar_t inFolderName[], wchar_t outDatName[])
 
 	printf("Files successfully packed!\n");
 	return 0;
+}
+
+// Times the model on its own, and whole entries through the range coder,
+// on generated inputs. If the CPU has SSE2, the model is timed both with
+// and without it, and the two have to agree on every result.
+int pbg6Bench()
+{
+	const int inputCount = 3;
+	const char* inputNames[inputCount] = { "text", "bitmap", "random" };
+	std::vector<uint8_t> inputs[inputCount];
+	inputs[0] = benchText(0x30000);
+	inputs[1] = benchBitmap(640, 480);
+	inputs[2] = benchNoise(0x100000);
+	const std::vector<uint8_t>& text = inputs[0];
+
+	const char* pathNames[2] = { "scalar", "SSE2" };
+	const int pathCount = sse2 ? 2 : 1;
+
+	CryptPools model;
+	std::vector<char> encoded[inputCount];
+	std::vector<char> decoded;
+	uint32_t checks[2] = { 0, 0 };
+	int failed = 0;
+
+	printf("PBG6 model calls (millions per second) and range coder (MB/s)\n");
+	for (int path = 0; path < pathCount; ++path) {
+		PBG6Codec codec(path == 1);
+		uint32_t& check = checks[path];
+
+		// Step() through the text, which also rescales now and then
+		BenchTimer stepTimer;
+		while (stepTimer.Running()) {
+			stepTimer.Start();
+			model.Init(path == 1);
+			for (size_t i = 0; i < text.size(); ++i) {
+				model.Step(text[i]);
+			}
+			stepTimer.Stop();
+		}
+		for (uint32_t sym = 0; sym < CP_SYMBOLS; ++sym) {
+			check = (check * 31) + model.CumFreq(sym);
+		}
+
+		// Find() on that model, for targets all over its range
+		const uint32_t targetCount = 0x1000;
+		const uint32_t targetRounds = 0x40;
+		std::vector<uint32_t> targets(targetCount);
+		BenchRandom random(5);
+		for (uint32_t i = 0; i < targetCount; ++i) {
+			targets[i] = (random.Next() % model.Total());
+			check = (check * 31) + model.Find(targets[i]);
+		}
+		BenchTimer findTimer;
+		uint32_t found = 0;
+		while (findTimer.Running()) {
+			findTimer.Start();
+			found = 0;
+			for (uint32_t round = 0; round < targetRounds; ++round) {
+				for (uint32_t i = 0; i < targetCount; ++i) {
+					found += model.Find(targets[i]);
+				}
+			}
+			findTimer.Stop();
+		}
+		check = (check * 31) + found;
+
+		// Build() from that model's frequencies
+		const uint32_t buildCount = 0x4000;
+		BenchTimer buildTimer;
+		while (buildTimer.Running()) {
+			buildTimer.Start();
+			for (uint32_t i = 0; i < buildCount; ++i) {
+				model.Build();
+			}
+			buildTimer.Stop();
+		}
+
+		printf("%-6s model   Build %7.2f   Find %7.2f   Step %7.2f\n", pathNames[path],
+			buildTimer.Rate(buildCount), findTimer.Rate((double)targetCount * targetRounds),
+			stepTimer.Rate((double)text.size()));
+
+		for (int input = 0; input < inputCount; ++input) {
+			const std::vector<uint8_t>& data = inputs[input];
+			const uint32_t size = (uint32_t)data.size();
+
+			BenchTimer encodeTimer;
+			while (encodeTimer.Running()) {
+				encodeTimer.Start();
+				codec.Encode((const char*)&data[0], size);
+				encodeTimer.Stop();
+			}
+			const std::vector<char>& result = codec.Encode((const char*)&data[0], size);
+			if (path == 0) {
+				encoded[input] = result;
+			}
+			else if (result != encoded[input]) {
+				printf("%s %s encoding differs from scalar!\n", pathNames[path], inputNames[input]);
+				++failed;
+			}
+
+			decoded.resize(size);
+			BenchTimer decodeTimer;
+			uint32_t crc = 0;
+			while (decodeTimer.Running()) {
+				decodeTimer.Start();
+				crc = codec.Decode(&encoded[input][0], &decoded[0], size, (uint32_t)encoded[input].size());
+				decodeTimer.Stop();
+			}
+			if ((memcmp(&decoded[0], &data[0], size) != 0) || (crc != crc32::update(0, &data[0], size))) {
+				printf("%s %s decoding doesn't match the input!\n", pathNames[path], inputNames[input]);
+				++failed;
+			}
+
+			printf("%-6s %-7s encode %7.1f   decode %7.1f\n", pathNames[path], inputNames[input],
+				encodeTimer.Rate(size), decodeTimer.Rate(size));
+		}
+	}
+
+	if ((pathCount == 2) && (checks[0] != checks[1])) {
+		printf("SSE2 model results differ from scalar!\n");
+		++failed;
+	}
+	return (failed == 0) ? 0 : -10;
 }
\ No newline at end of file